@@ -34,8 +34,11 @@
 
  */
 
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -51,6 +54,95 @@
 
 
 
+static bkupInfo* sshMaster;     /* info of the running ssh master */
+static pid_t     sshOwner;      /* process that started the master */
+static int       sshRunning;    /* the master has been started */
+
+
+/* Ask the ssh master started by openSshMaster() to exit and remove
+   its control directory.  Registered with atexit() so that the
+   master doesn't outlive backupfs when it exits with errExit().
+ */
+static void
+closeSshMaster (void)
+{
+    bkupInfo*  info = sshMaster;
+    char*      cmd;
+    char*      s;
+    int        len;
+    pipeExitSt st;
+
+
+    if (!info || getpid() != sshOwner) return;
+    sshMaster = NULL;
+    if (!sshRunning) goto removeDir;
+
+    len = strlen(SSH_EXIT) + strlen(info->sshctl) +
+          strlen(info->user) + strlen(info->host) + 1;
+    cmd = malloc(len);
+    if (cmd) {
+        snprintf(cmd, len, SSH_EXIT, info->sshctl, info->user, info->host);
+        st = execCommands(cmd, NULL);
+        chkCmdExitSt(st, cmd);
+        free(cmd);
+    } else {
+        errSysRet(("malloc(%d)", len));
+    }
+
+removeDir:
+    unlink(info->sshctl);
+    s = rindex(info->sshctl, '/');
+    *s = '\0';
+    if (rmdir(info->sshctl)) errSysRet(("rmdir(%s)", info->sshctl));
+    *s = '/';
+}
+
+
+/* Start a ssh master connection to info->host in the background.
+   Every pass of a remote backup runs over it (-S info->sshctl), so
+   the key exchange and authentication are done once per backup.
+   If the master can't be started, each ssh connects by itself.
+ */
+void
+openSshMaster (bkupInfo* info)
+{
+    char*      cmd;
+    char*      dir;
+    int        len;
+    pipeExitSt st;
+
+
+    assert(info);
+    assert(info->sshid);
+    assert(info->host);
+
+    len = strlen(SSH_CTL_DIR) + strlen(SSH_CTL_SOCK) + 2;
+    info->sshctl = malloc(len);
+    if (!info->sshctl) errSysExit(("malloc(sshctl:%d)", len));
+    strcpy(info->sshctl, SSH_CTL_DIR);
+    dir = mkdtemp(info->sshctl);
+    if (!dir) errSysExit(("mkdtemp(%s)", info->sshctl));
+    strcat(info->sshctl, "/");
+    strcat(info->sshctl, SSH_CTL_SOCK);
+
+    len = strlen(SSH_MASTER) + strlen(info->sshid) + strlen(info->sshctl) +
+          strlen(info->user) + strlen(info->host) + 1;
+    cmd = malloc(len);
+    if (!cmd) errSysExit(("malloc(%d)", len));
+    snprintf(cmd, len, SSH_MASTER,
+                      info->sshid, info->sshctl, info->user, info->host);
+    sshMaster = info;
+    sshOwner  = getpid();
+    if (atexit(closeSshMaster)) errRet(("atexit(closeSshMaster)"));
+    st = execCommands(cmd, NULL);
+    sshRunning = chkCmdExitSt(st, cmd);
+    if (!sshRunning) {
+        errRet(("%s: can't start ssh master. Connecting for each pass",
+                                                               info->host));
+    }
+    free(cmd);
+}
+
 /* Make a SSH secret key (ID file) name and store it to info->sshid.
    Also check whether the file exists or not.
  */
@@ -100,12 +192,12 @@ chkRemoteSrc (bkupInfo* info)
     assert(info);
     assert(info->bdir);
 
-    len = strlen(RMT_PASS1_1) + strlen(info->sshid) +
-           strlen(info->host) + strlen(info->src) + 1;
+    len = strlen(RMT_PASS1_1) + strlen(info->sshid) + strlen(info->sshctl) +
+       strlen(info->user) + strlen(info->host) + strlen(info->src) + 1;
     cmd = malloc(len);
     if (!cmd) errSysExit(("malloc(%d)", len));
-    snprintf(cmd, len,
-                RMT_PASS1_1, info->sshid, info->user, info->host, info->src);
+    snprintf(cmd, len, RMT_PASS1_1, info->sshid, info->sshctl,
+                                        info->user, info->host, info->src);
     st = execCommands(cmd, RMT_PASS1_2);
     status = chkPipeExitSt (st, cmd, RMT_PASS1_2);
     free(cmd);
@@ -298,20 +390,20 @@ lastBkupDirFromTime (time_t mtime, bkupInfo* info)
 }
 
 
-/* Execute remote backup commands
-    1. Create directory, link, and tar input files
-       in ~backupfs/ on remote host
-    2. Create directories for backup on server
-    3. Create hard links on server
-    4. Copy new files for backup from remote host and store them
+/* Execute remote backup
+    1. Run backupfs-remote on remote host, which sends directories,
+       links, and new files as records (see stream.c)
+    2. Create the directories, hard links, and files on server
+       as the records arrive
+    3. Link the new files to the content store if info->store
  */
 int
 doRemote (bkupInfo* info)
 {
-    int        len, len2, cmdlen;
-    time_t     tm;
-    char*      cmd[2];
-    char       stime[16];       /* time() in hex string */
+    int        len;
+    int        rv;
+    int        ack[2] = { -1, -1 };
+    char*      cmd;
     pipeExitSt st;
 
 
@@ -320,107 +412,36 @@ doRemote (bkupInfo* info)
     assert(info->dest);
     assert(info->host);
 
-    /* cd backup-directory for "tar xpf -"
+    /* Unless -s 1, backupfs-remote lists the files to be fetched by
+       other connections, and waits for `1' in ack[0] after that.
      */
-    if (chdir(info->bdir)) errSysExit(("chdir(%s)", info->bdir));
-
-    cmdlen = MAXCHARS/2;
-    cmd[0] = malloc(2*cmdlen);  /* for 2 commdands */
-    if (!cmd[0]) errSysExit(("malloc(cmd[0]:%d)", cmdlen));
-    cmd[1] = cmd[0] + cmdlen;
-
-    tm = time(NULL);
-    snprintf(stime, sizeof(stime), "%08lx", tm);
-
-    /* Remote new directories name: dirs-<host>-<time>
-     */
-    len  = strlen(info->host) + strlen (stime) + 1;
-    len2 = strlen(RMT_DIR_FILE);
-    info->ndpath = malloc(len + len2);
-    if (!info->ndpath) errSysExit(("malloc(ndpath:%d)", len));
-    snprintf(info->ndpath, len+len2, RMT_DIR_FILE, info->host, stime);
-
-    /* Remote hard link info file name: links-<host>-<time>
-     */
-    len2 = strlen(RMT_LNK_FILE);
-    info->linkpath = malloc(len + len2);
-    if (!info->linkpath) errSysExit(("malloc(linkpath:%d)", len));
-    snprintf(info->linkpath, len+len2, RMT_LNK_FILE, info->host, stime);
-
-    /* Remote tar file name: tar-<host>-<time>
-     */
-    len2 = strlen(RMT_TAR_FILE);
-    info->tpath = malloc(len + len2);
-    if (!info->tpath) errSysExit(("malloc(tpath:%d)", len));
-    snprintf(info->tpath, len + len2, RMT_TAR_FILE, info->host, stime);
-
-
-    /* ssh -i <rsa_id> backupfs@<host> \
-       backupfs-remote <src-dir> <bkup-dir> <host> <time-in-hex>
-     */
-    if (snprintf(cmd[0], cmdlen, RMT_PASS2, info->sshid, info->user,
-           info->host, info->src, info->bdir, info->host, stime) >= cmdlen) {
-        errExit(("cmdlen (%d:%s) too short" , cmdlen, cmd[0]));
-    }
-    st = execCommands(cmd[0], NULL);
-    if (!chkCmdExitSt(st, cmd[0])) goto removeFiles;
-
-    /* ssh -i <rsa_id> backupfs@<host> cat <new-dir-path> | backupfs-mkdir
-     */
-    if (snprintf(cmd[0], cmdlen, RMT_PASS3_1, info->sshid, info->user,
-                                       info->host, info->ndpath) >= cmdlen) {
-        errRet(("cmdlen (%d) too short" , cmdlen));
-        goto removeFiles;
-    }
-    if (strlen(RMT_PASS3_2) >= cmdlen) {
-        errRet(("cmdlen (%d:RMT_PASS3_2) too short" , cmdlen));
-        goto removeFiles;
+    if (info->streams != 1 && pipe2(ack, O_CLOEXEC)) {
+        errSysRet(("pipe. Files are sent in one stream"));
+        info->streams = 1;
+        ack[0] = ack[1] = -1;
     }
-    strcpy(cmd[1], RMT_PASS3_2);
-    st = execCommands(cmd[0], cmd[1]);
-    if (!chkPipeExitSt(st, cmd[0], cmd[1])) goto removeFiles;
+    info->ackfd = ack[1];
 
-    /* ssh -i <rsa_id> backupfs@<host> cat <new-dir-path> | \
-       backupfs-mklink <dest-dir> <backup-dir>
+    /* ssh -i <rsa_id> -S <ctl> backupfs@<host> \
+       backupfs-remote [-m] [-H] [-l] <src-dir> <bkup-dir>
      */
-    if (snprintf(cmd[0], cmdlen, RMT_PASS4_1, info->sshid, info->user,
-                                     info->host, info->linkpath) >= cmdlen) {
-        errRet(("cmdlen (%d:%s) too short" , cmdlen, cmd[0]));
-        goto removeFiles;
-    }
-    if (snprintf(cmd[1], cmdlen, RMT_PASS4_2, info->dest, info->bdir)
-                                                                 >= cmdlen) {
-        errRet(("cmdlen (%d:%s) too short" , cmdlen, cmd[1]));
-        goto removeFiles;
-    }
-    st = execCommands(cmd[0], cmd[1]);
-    if (!chkPipeExitSt(st, cmd[0], cmd[1])) goto removeFiles;
-
-    /* ssh -i <rsa_id> backupfs@<host> \
-       backupfs-exectar <host> <time-in-hex> | tar xpf -
-     */
-    if (snprintf(cmd[0], cmdlen, RMT_PASS5_1, info->sshid, info->user,
-                                  info->host, info->host, stime) >= cmdlen) {
-        errRet(("cmdlen (%d) too short" , cmdlen));
-        goto removeFiles;
-    }
-    if (strlen(RMT_PASS5_2) >= cmdlen) {
-        errRet(("cmdlen (RMT_PASS5_2:%d) too short" , cmdlen));
-        goto removeFiles;
-    }
-    strcpy(cmd[1], RMT_PASS5_2);
-    st = execCommands(cmd[0], cmd[1]);
-    chkPipeExitSt(st, cmd[0], cmd[1]);
-
-removeFiles:
-    if (snprintf(cmd[0], cmdlen, RMT_PASS6, info->sshid, info->user,
-          info->host, info->ndpath, info->linkpath, info->tpath) >= cmdlen) {
-        errExit(("cmdlen (%d) too short" , cmdlen));
+    len = strlen(RMT_PASS2) + strlen(info->sshid) + strlen(info->sshctl) +
+          strlen(info->user) + strlen(info->host) + strlen(info->src) +
+          strlen(info->bdir) + 1;
+    cmd = malloc(len);
+    if (!cmd) errSysExit(("malloc(cmd:%d)", len));
+    snprintf(cmd, len, RMT_PASS2, info->sshid, info->sshctl, info->user,
+             info->host, info->sorted ? "-m " : "", info->hdd ? "-H " : "",
+             info->streams != 1 ? "-l " : "", info->src, info->bdir);
+    st = execReader(cmd, recvStream, ack[0], info, &rv);
+    rv = chkCmdExitSt(st, cmd) && rv;
+    if (ack[0] >= 0) close(ack[0]);
+    if (ack[1] >= 0) close(ack[1]);
+    if (rv && info->store) {
+        storeTree(info);
     }
-    st = execCommands(cmd[0], NULL);
-    chkCmdExitSt(st, cmd[0]);
-
-    return 0;                   /* success */
+    free(cmd);
+    return !rv;
 }
 
 
@@ -453,13 +474,45 @@ newDirectory (char* bkupdir, struct stat* pst, bkupInfo* info)
 }
 
 
+/* A link queued in io_uring by makeLink() failed. Copy the
+   file instead, as recurrentBackup() does if makeLink() fails.
+ */
+static void
+linkFailedLocal (char* src, char* dest, int err, void* arg)
+{
+    bkupInfo* info = arg;
+
+
+    errno = err;
+    errSysRet(("linkat(%s, %s)", src, dest));
+    backupFile(dest + info->blen, NULL, 0, info);
+}
+
+
+/* Hard link `src' to `dest' relative to the directories kept
+   open by this dirwalk() thread. With -u, the link is queued
+   in io_uring and made by the time dirwalk() returns.
+   A source file with more than one name is linked at once:
+   the other names follow its first one (see firstLink()), which
+   must not fall back to a copy after they have been linked.
+ */
 int
 makeLink(char* src, char* dest, bkupInfo* info)
 {
     assert(src);
     assert(dest);
 
-    return !link(src, dest);
+    if (info->hardLinks && info->stbuf->st_nlink > 1) {
+        return !link(src, dest);
+    }
+
+    if (!info->dirs) {
+        info->dirs = dirCacheNew(linkDirs);
+        if (info->dirs && info->uring) {
+            dirCacheRing(info->dirs, linkFailedLocal, info);
+        }
+    }
+    return dirCacheLink(src, dest, info->dirs);
 }
 
 
@@ -469,21 +522,12 @@ openFilesLocal (bkupInfo* info)
     assert(info);
     assert(info->jpath);
 
-    info->tpath = malloc(strlen(TAR_FILE) + 1);
-    if (!info->tpath) {
-        errSysRet(("malloc(tpath:%d)", strlen(TAR_FILE) + 1));
-        goto errorExit;
-    }
-    strcpy(info->tpath, TAR_FILE);
-    
-    info->jnl = fopen(info->jpath, "w");
-    if (!info->jnl) {
-        errSysRet(("fopen(%s)", info->jpath));
+    if (!openJournal(info)) {
+        errRet(("can't open journal (%s)", info->jpath));
         goto errorExit;
     }
-    info->tar = makeTemp(info->tpath, "w+");
-    if (!info->tar) {
-        errRet(("can't make temporary file (%s)", info->tpath));
+    if (!copyStart(info)) {
+        errRet(("can't start copy threads"));
         goto errorExit;
     }
     return;                     /* success */
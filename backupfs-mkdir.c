@@ -67,15 +67,8 @@ int
 main (int argc, char* argv[])
 {
     ssize_t     len;
-    int         i;
     size_t      bufSize;
-    mode_t      mode;
-    uid_t       uid;
-    gid_t       gid;
-    struct stat stbuf;
     char*       line;
-    char*       p;
-    char*       q;
 
 
     if (!Debug && getuid() != ROOT_UID) {
@@ -87,7 +80,6 @@ main (int argc, char* argv[])
     }
 
 
-    p       = NULL;
     bufSize = MAXCHARS;
     line = malloc(bufSize);
     if (!line) {
@@ -101,49 +93,10 @@ main (int argc, char* argv[])
         }
 
         line[len-1] = '\0';
-        p   = line;
-        for (i = 0; i < 3; ++i) {
-            q = index(p, ' ');
-            switch (i) {
-            case 0:
-                uid = strtol(p, NULL, 16);
-                break;
-            case 1:
-                gid = strtol(p, NULL, 16);
-                break;
-            case 2:
-                mode = strtol(p, NULL, 16);
-                break;
-            default:
-                errExit(("%d: shouldn't happen", i));
-                break;
-            }
-            p = q + 1;
-        }
         if (Debug) {
-            printf("%5d %5d 0x%08x %s\n", (int)uid, (int)gid, mode, p);
-        } else if (!stat(p, &stbuf)) {
-            if (S_ISDIR(stbuf.st_mode)) {
-                if (chown(p, uid, gid)) {
-                    errSysRet(("chown(%s, 0x%08x, 0x%08x)", p, uid, gid));
-                } else {
-                    if (chmod(p, mode)){
-                        errSysRet(("chmod(%s, 0x%08x)", p, mode));
-                    }
-                }
-            } else {
-                errSysRet(("%s: not a directory", p));
-            }
-        } else if (errno == ENOENT) {
-            if (mkdir(p, mode)) {
-                errSysRet(("mkdir(%s, 0x%08x)", p, mode));
-            } else {
-                if (chown(p, uid, gid)) {
-                    errSysRet(("chown(%s, 0x%08x, 0x%08x)", p, uid, gid));
-                }
-            }
+            printf("%s\n", line);
         } else {
-            errSysRet(("stat(%s)", p));
+            makeNewDir(line);
         }
     }
     free(line);
@@ -36,8 +36,10 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <signal.h>
 #include <string.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
@@ -47,6 +49,7 @@
 
 #include "string-rbt.h"
 #include "backupfs.h"
+#include "platform.h"
 #include "error.h"
 
 
@@ -90,25 +93,22 @@ writeDestDir (bkupInfo* info)
 }
 
 
-/* Write last backup time to info->linkpath.
-   This function must be called before writing link info.
+/* Send last backup time as recTime.
+   This function must be called before sending links.
  */
 static void
 writeLastBakupTime (time_t mtime, bkupInfo* info)
 {
-    static char buf[32];
+    char buf[32];
+    int  len;
 
 
     assert(info);
-    assert(info->links);
-    assert(info->linkpath);
+    assert(info->stream);
     assert(info->oldJpath);
-    assert(ftell(info->links) == 0);
 
-    if (snprintf(buf, sizeof(buf), "0x%08lx\n", mtime) >= sizeof(buf)) {
-        errExit(("0x%08lx\\n: string too long", mtime));
-    }
-    fwriteExit(buf, info->links, info->linkpath, info);
+    len = snprintf(buf, sizeof(buf), "0x%08lx", mtime);
+    putRecord(recTime, buf, len, info);
 }
 
 
@@ -123,97 +123,284 @@ lastBkupDirFromTime (time_t mtime, bkupInfo* info)
 }
 
 
-/* Write directory name and mode to info->ndpath
+/* Send directory name and mode as recDir
  */
 int
 newDirectory (char* bkupdir, struct stat* pst, bkupInfo* info)
 {
-    char buf[64];
+    char* rec;
+    int   len;
 
 
     assert(bkupdir);
     assert(pst);
     assert(info);
-    assert(info->newdirs);
 
-    snprintf(buf, sizeof(buf), "0x%08x 0x%08x 0x%08x ",
-                           (int)pst->st_uid, (int)pst->st_gid, pst->st_mode);
-    fwriteExit(buf, info->newdirs, info->ndpath, info);
-    fwriteExit(bkupdir, info->newdirs, info->ndpath, info);
-    fwriteExit("\n", info->newdirs, info->ndpath, info);
+    len = strlen(bkupdir) + 64;
+    rec = malloc(len);
+    if (!rec) errSysExit(("malloc(%d)", len));
+    len = snprintf(rec, len, "0x%08x 0x%08x 0x%08x %s", (int)pst->st_uid,
+                   (int)pst->st_gid, pst->st_mode, bkupdir);
+    putRecord(recDir, rec, len, info);
+    free(rec);
     return 1;
 }
 
 
-/* Write path to be hard linked (on server) to info->linkpath
+/* Send path to be hard linked (on server) as recLink.
+   If the file was moved, send LINK_MOVED, its new path, and
+   then its old path `src'.
  */
 int
 makeLink(char* src, char* dest, bkupInfo* info)
 {
-    fwriteExit(src, info->links, info->linkpath, info);
-    fwriteExit("\0", info->links, info->linkpath, info);
+    char* rec;
+    char* path = dest + info->blen;
+    int   len;
+
+
+    if (!strcmp(src, path)) {
+        putRecord(recLink, src, strlen(src), info);
+        return 1;
+    }
+    len = strlen(LINK_MOVED) + strlen(path) + 1 + strlen(src);
+    rec = malloc(len + 1);
+    if (!rec) errSysExit(("malloc(%d)", len + 1));
+    strcpy(rec, LINK_MOVED);
+    strcat(rec, path);
+    strcpy(rec + strlen(rec) + 1, src);
+    putRecord(recLink, rec, len, info);
+    free(rec);
     return 1;
 }
 
 
-void
-openFilesRemote (bkupInfo* info)
+/* Files to send are queued here by backupFile() and sent by
+   sender() while dirwalk() goes on.  With -H they are all sent
+   by sendFinish() in disk order instead.
+   With -l, backupFile() sends them as recQueue, and backupfs fetches
+   them with backupfs-remote -f, which queues them here by fetchFiles().
+ */
+typedef struct {
+    uint64_t key;
+    char*    path;
+} sendEnt;
+
+static sendEnt*        sendList;
+static int             nsend;
+static int             nextSend;
+static int             sendMax;
+static int             sendClosed;
+static int             sending;     /* sender() is running */
+static pthread_t       sendThread;
+static pthread_mutex_t sendLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  sendCond = PTHREAD_COND_INITIALIZER;
+
+
+static int
+sendCmp (const void* a, const void* b)
 {
-    int len, hlen, tlen;
+    const sendEnt* x = a;
+    const sendEnt* y = b;
 
+    return x->key < y->key ? -1 : x->key > y->key;
+}
 
-    assert(info);
-    assert(info->dest);
-    assert(info->host);
-
-    hlen = strlen(info->host);
-    tlen = strlen(info->dest);  /* info->dest is used to hold time string */
-    len  = strlen(RMT_DIR_FILE) + hlen + tlen;
-    info->ndpath = malloc(len);
-    if (!info->ndpath) {
-        errSysRet(("malloc(ndpath:%d)", len));
-        goto errorExit;
+
+static void*
+sender (void* arg)
+{
+    bkupInfo* info = arg;
+    char*     path;
+
+
+    pthread_mutex_lock(&sendLock);
+    for (;;) {
+        while (nextSend == nsend && !sendClosed) {
+            pthread_cond_wait(&sendCond, &sendLock);
+        }
+        if (nextSend == nsend) break;
+        path = sendList[nextSend++].path;
+        if (nextSend == nsend) nextSend = nsend = 0;
+        pthread_mutex_unlock(&sendLock);
+        putFile(path, info);
+        free(path);
+        pthread_mutex_lock(&sendLock);
     }
-    snprintf(info->ndpath, len, RMT_DIR_FILE, info->host, info->dest);
+    pthread_mutex_unlock(&sendLock);
+    return NULL;
+}
 
-    len = strlen(RMT_LNK_FILE) + hlen + tlen;
-    info->linkpath = malloc(len);
-    if (!info->linkpath) {
-        errSysRet(("malloc(linkpath:%d)", len));
-        goto errorExit;
+
+/* Start sender() unless -H or -l
+ */
+void
+sendStart (bkupInfo* info)
+{
+    assert(info);
+
+    if (info->hdd || info->listOnly) return;
+    if (pthread_create(&sendThread, NULL, sender, info)) {
+        errRet(("can't start sender. Files are sent after dirwalk()"));
+        return;
     }
-    snprintf(info->linkpath, len, RMT_LNK_FILE, info->host, info->dest);
+    sending = 1;
+}
 
-    len = strlen(RMT_TAR_FILE) + hlen + tlen;
-    info->tpath = malloc(len);
-    if (!info->tpath) {
-        errSysRet(("malloc(tpath:%d)", len));
-        goto errorExit;
+
+/* Queue path for sender() or sendFinish()
+ */
+static void
+queueSend (char* path, bkupInfo* info)
+{
+    sendEnt* p;
+    uint64_t key;
+    char*    s;
+
+
+    key = info->hdd ? diskOrder(path) : 0;
+    s = strdup(path);
+    if (!s) errSysExit(("strdup(%s)", path));
+    pthread_mutex_lock(&sendLock);
+    if (nsend == sendMax) {
+        sendMax = sendMax ? 2 * sendMax : 1024;
+        p = realloc(sendList, sendMax * sizeof(*sendList));
+        if (!p) errSysExit(("realloc(%d)", sendMax));
+        sendList = p;
     }
-    snprintf(info->tpath, len, RMT_TAR_FILE, info->host, info->dest);
+    sendList[nsend].key  = key;
+    sendList[nsend].path = s;
+    ++nsend;
+    pthread_cond_signal(&sendCond);
+    pthread_mutex_unlock(&sendLock);
+}
 
-    info->newdirs = fopen(info->ndpath, "w");
-    if (!info->newdirs) {
-        errSysRet(("fopen(%s)", info->ndpath));
-        goto errorExit;
+
+/* Send "0x<size> <dev:ino> <path>" as recQueue.  <dev:ino> is `-'
+   unless the file has other names, which must go to the same stream.
+ */
+static void
+listFile (char* path, off_t size, bkupInfo* info)
+{
+    struct stat st;
+    char        key[48];
+    char*       rec;
+    int         len;
+
+
+    strcpy(key, "-");
+    if (!lstat(path, &st) && st.st_nlink > 1 && !S_ISDIR(st.st_mode)) {
+        snprintf(key, sizeof(key), "%llx:%llx",
+                 (unsigned long long)st.st_dev, (unsigned long long)st.st_ino);
     }
-    info->links = fopen(info->linkpath, "w");
-    if (!info->links) {
-        errSysRet(("fopen(%s)", info->linkpath));
-        goto errorExit;
+    len = strlen(path) + sizeof(key) + 32;
+    rec = malloc(len);
+    if (!rec) errSysExit(("malloc(%d)", len));
+    len = snprintf(rec, len, "0x%llx %s %s", (long long)size, key, path);
+    putRecord(recQueue, rec, len, info);
+    free(rec);
+}
+
+
+/* Queue path to be sent as recFile, or list it as recQueue (-l).
+   `last' is not used: whole files are sent.
+   The journal is sent by sendFinish() after it is closed.
+ */
+void
+backupFile (char* path, char* last, off_t size, bkupInfo* info)
+{
+    if (!strcmp(path, info->jpath)) return;
+    if (info->listOnly) {
+        listFile(path, size, info);
+    } else {
+        queueSend(path, info);
     }
-    info->tar = fopen(info->tpath, "w");
-    if (!info->tar) {
-        errSysRet(("fopen(%s)", info->tpath));
-        goto errorExit;
+}
+
+
+/* Queue the files listed in `fp' ('\0' separated) for sendFinish()
+   (backupfs-remote -f).  They must be under info->src.
+ */
+void
+fetchFiles (FILE* fp, bkupInfo* info)
+{
+    char*   path = NULL;
+    size_t  size = 0;
+    ssize_t len;
+    int     slen;
+
+
+    assert(fp);
+    assert(info);
+    assert(info->src);
+
+    slen = strlen(info->src);
+    while ((len = getdelim(&path, &size, '\0', fp)) > 0) {
+        if (path[len - 1] == '\0') --len;
+        path[len] = '\0';
+        if (strncmp(path, info->src, slen) || path[slen] != '/' ||
+            strstr(path, "/../")) {
+            errRet(("%s: not under %s", path, info->src));
+            continue;
+        }
+        queueSend(path, info);
     }
+    if (ferror(fp)) errSysRet(("read(file list)"));
+    free(path);
+}
 
-    return;                     /* success */
 
+/* Tell backupfs that the files are all listed (-l), and wait until
+   it fetches them.  Return 1 if it did.  Return 0 otherwise.
+ */
+static int
+waitFetch (bkupInfo* info)
+{
+    if (fflush(stdout)) errSysRet(("fflush(stdout)"));
+    putRecord(recWait, NULL, 0, info);
+    if (fflush(info->stream)) errSysExit(("fflush(stream)"));
+    return getchar() == '1';
+}
 
-errorExit:
-    closeFiles(info);
-    exit(1);
+
+/* Send the rest of the files and the journal, and end the stream.
+   Must be called after dirwalk() returns.
+ */
+void
+sendFinish (bkupInfo* info)
+{
+    int i;
+
+
+    assert(info);
+
+    if (sending) {
+        pthread_mutex_lock(&sendLock);
+        sendClosed = 1;
+        pthread_cond_signal(&sendCond);
+        pthread_mutex_unlock(&sendLock);
+        pthread_join(sendThread, NULL);
+        sending = 0;
+    }
+    if (info->hdd) qsort(sendList, nsend, sizeof(*sendList), sendCmp);
+    for ( i = nextSend; i < nsend; ++i ) {
+        putFile(sendList[i].path, info);
+        free(sendList[i].path);
+    }
+    free(sendList);
+    sendList = NULL;
+    nsend = nextSend = sendMax = 0;
+
+    if (info->jnl && !closeJournal(info)) {
+        errRet(("closeJournal(%s)", info->jpath));
+    }
+    if (info->jpath) putFile(info->jpath, info);
+    freeSentFiles();
+    if (info->listOnly && !waitFetch(info)) {
+        errRet(("files are not fetched. The journal is restored"));
+        backupfsExit(info, 1);
+    }
+    closeStream(info);
 }
 
 
@@ -223,9 +410,8 @@ openJournalFile (bkupInfo* info)
     assert(info);
     assert(info->jpath);
 
-    info->jnl = fopen(info->jpath, "w");
-    if (!info->jnl) {
-        errSysRet(("fopen(%s)", info->jpath));
+    if (!openJournal(info)) {
+        errRet(("can't open journal (%s)", info->jpath));
         goto errorExit;
     }
 
@@ -91,35 +91,10 @@ main (int argc, char* argv[])
         *p++ = '\0';
     }
     if (strcmp(cmd[0], "backupfs-chksrc") &&
-        strcmp(cmd[0], "backupfs-remote") &&
-        strcmp(cmd[0], "backupfs-exctar") &&
-        strcmp(cmd[0], "cat") && strcmp(cmd[0], "rm")) {
+        strcmp(cmd[0], "backupfs-remote")) {
         fprintf(stderr, "%s: command not allowed\n", cmd[0]);
         exit(1);
     }
 
-    if (!strcmp(cmd[0], "cat")) {
-        if (!cmd[1]) {
-            exit(2);
-        }
-        if (strncmp(cmd[1], "dirs-", 5) &&
-            strncmp(cmd[1], "links-", 6) &&
-            strncmp(cmd[1], "tar-", 4)) {
-            fprintf(stderr, "%s %s: file not allowed\n", cmd[0], cmd[1]);
-            exit(3);
-        }
-    } else if (!strcmp(cmd[0], "rm")) {
-        if (!cmd[1]) {
-            exit(4);
-        }
-        if (!cmd[2]) {
-            exit(5);
-        }
-        if (strncmp(cmd[2], "dirs-", 5)) {
-            fprintf(stderr, "%s %s: file not allowed\n", cmd[0], cmd[2]);
-            exit(7);
-        }
-    }
-        
     exit(execvp(cmd[0], cmd));
 }
@@ -140,16 +140,27 @@ int
 getLastBkupDir (bkupInfo* info)
 {
     journalEntry* pEnt;
+    char* dir;
+    char* file;
 
 
     assert(info);
-    assert(info->jt);
+    assert(info->ojnl);
     assert(info->jpath);
 
-    /* Try to find the journal file in the journal tree.
+    /* Try to find the journal file in the old journal.
        Consider first time backup if there is no entry.
      */
-    pEnt = stringRBTfind(info->jt, info->jpath);
+    file = rindex(info->jpath, '/');
+    assert(file);
+    dir = malloc(file - info->jpath + 1);
+    if (!dir) {
+        errSysExit(("malloc(%s)", info->jpath));
+    }
+    memcpy(dir, info->jpath, file - info->jpath);
+    dir[file - info->jpath] = '\0';
+    pEnt = findJournal(dir, file + 1, info);
+    free(dir);
     if (!pEnt) {
         fprintf(stderr, "%s: No journal file found\n", __FUNCTION__);
         return 0;
@@ -158,13 +169,12 @@ getLastBkupDir (bkupInfo* info)
 }
 
 
-/* Add all the file under info->src to info->tar for backup.
+/* Back up all the file under info->src with backupFile().
    Also create journal file.
  */
 void
 firstTimeBackup (char* dir, char* file, bkupInfo* info)
 {
-    char* buf;
     char* path;
     int   buflen;
 
@@ -173,29 +183,29 @@ firstTimeBackup (char* dir, char* file, bkupInfo* info)
     assert(file);
     assert(info);
     
-    buflen = strlen(dir) + strlen(file) + 80; /* 80 is just margin */
-    buf = malloc(buflen);
-    if (!buf) {
+    buflen = strlen(dir) + strlen(file) + 2; /* 1 is for `/' */
+    path = malloc(buflen);
+    if (!path) {
         errSysExit(("malloc(%d)", buflen));
     }
-    snprintf(buf, buflen, "%08lx %08lx ", info->ctime, info->mtime);
-    path = buf + strlen(buf);
     strcpy(path, dir);
     strcat(path, "/");
     strcat(path, file);
 
-    fwriteExit(path, info->tar, info->tpath, info);
-    fwriteExit("\n", info->tar, info->tpath, info);
+    backupFile(path, NULL, 0, info);
 
-    fwriteExit(buf, info->jnl, info->jpath, info);
-    fwriteExit("\n", info->jnl, info->jpath, info);
-    free(buf);
+    writeJournal(dir, file, info);
+    free(path);
 }
 
 
 /* Check each file under info->src and:
-     1. add it to info->tar for backup if it is new or changed
-     2. make hard link from the last backup if it is not changed.
+     1. back it up with backupFile() if it is new or changed
+     2. make hard link from the last backup if it is not changed
+        or if it was moved from another path.
+   All the names of a file with more than one link follow the
+   first one: they are all copied, or all linked from the same
+   file in the last backup.
  */
 void
 recurrentBackup (char* dir, char* file, bkupInfo* info)
@@ -205,18 +215,24 @@ recurrentBackup (char* dir, char* file, bkupInfo* info)
     char* path;                 /* backup source path */
     char* bpath;                /* backup path */
     char* lspath;               /* link src path */
+    char* odir;                 /* old path name of a moved file */
+    char* ofile;
+    char* mvpath;               /* link src path of a moved file */
+    char* lnpath;               /* link src path of another name */
     int   buflen;
     int   bplen;                /* backup path length */
+    int   mvlen;
+    int   first = linkNone;     /* see firstLink() */
 
 
     assert(dir);
     assert(file);
     assert(info);
     assert(info->bdir);
-    assert(info->jt);
+    assert(info->ojnl);
 
-    buflen = info->lblen + strlen(dir) + strlen(file) + 40;
-    buf  = malloc(buflen);  /* 40 for ctime and mtime */
+    buflen = info->lblen + strlen(dir) + strlen(file) + 2;
+    buf  = malloc(buflen);      /* 1 is for `/' */
     if (!buf) {
         errSysExit(("malloc(%s, %s/%s)",
                            info->lbdir ? info->lbdir : "REMOTE", dir, file));
@@ -230,28 +246,61 @@ recurrentBackup (char* dir, char* file, bkupInfo* info)
     if (!bpath) {
         errSysExit(("malloc(%s/%s/%s)", info->bdir, dir, file));
     }
-    snprintf(buf, buflen, "%08lx %08lx ", info->ctime, info->mtime);
-    lspath = buf + strlen(buf) + 1; /* don't concat lspath and time */
+    lspath = buf;
     path   = lspath + info->lblen;
     strcpy(path, dir);
     strcat(path, "/");
     strcat(path, file);
     strcpy(bpath, info->bdir);
     strcat(bpath, path);        /* "/" no need since dir is absolute */
-    pEnt = stringRBTfind(info->jt, path);
-    if (pEnt &&
-           ((info->ctime == pEnt->ctime) && (info->mtime == pEnt->mtime))) {
+    pEnt = matchJournal(dir, file, info);
+    if (info->stbuf->st_nlink > 1) {
+        /* Back up all the names of an inode the same way
+         */
+        first = firstLink(&lnpath, info);
+        if (first == linkCopied) goto newOrChanged;
+        if (first == linkLinked) {
+            if (makeLink(lnpath, bpath, info)) {
+                printf("linked:    %s\n", path);
+                goto writeJournal;
+            }
+            errRet(("makeLink %s %s\n", lnpath, bpath));
+            goto newOrChanged;
+        }
+    }
+    if (pEnt && isUnchanged(pEnt, info)) {
         memcpy(lspath, info->lbdir, info->lblen);
         if (makeLink(lspath, bpath, info)) {
             printf("unchanged: %s\n", path);
+            if (first == linkFirst) setFirstLink(lspath, info);
             goto writeJournal;
         } else {
             errRet(("makeLink %s %s\n", lspath, bpath));
-            goto writeTar;
+            goto newOrChanged;
         }
     }
+    if (!pEnt && findMoved(&odir, &ofile, info)) {
+        /* Moved or renamed: link the last backup at the old path
+         */
+        mvlen = info->lblen + strlen(odir) + strlen(ofile) + 2;
+        mvpath = malloc(mvlen);
+        if (!mvpath) {
+            errSysExit(("malloc(%s/%s)", odir, ofile));
+        }
+        memcpy(mvpath, info->lbdir, info->lblen);
+        snprintf(mvpath + info->lblen, mvlen - info->lblen, "%s/%s",
+                 odir, ofile);
+        if (makeLink(mvpath, bpath, info)) {
+            printf("moved:     %s\n", path);
+            if (first == linkFirst) setFirstLink(mvpath, info);
+            free(mvpath);
+            goto writeJournal;
+        }
+        errRet(("makeLink %s %s\n", mvpath, bpath));
+        free(mvpath);
+    }
 
-writeTar:
+newOrChanged:
     /* New file or file was modified.
      */
     if (pEnt) {
@@ -259,13 +308,20 @@ writeTar:
     } else {
         printf("new file:  %s\n", path);
     }
-    fwriteExit(path, info->tar, info->tpath, info);
-    fwriteExit("\n", info->tar, info->tpath, info);
+    if (pEnt && isAppended(pEnt, info)) {
+        memcpy(lspath, info->lbdir, info->lblen);
+        backupFile(path, lspath, pEnt->size, info);
+    } else if (pEnt && S_ISREG(info->stbuf->st_mode) &&
+               info->stbuf->st_size >= deltaMinSize) {
+        memcpy(lspath, info->lbdir, info->lblen);
+        backupFile(path, lspath, 0, info);
+    } else {
+        backupFile(path, NULL, 0, info);
+    }
+    if (first == linkFirst) setFirstLink(NULL, info);
 
 writeJournal:
-    fwriteExit(buf, info->jnl, info->jpath, info);
-    fwriteExit(path, info->jnl, info->jpath, info);
-    fwriteExit("\n", info->jnl, info->jpath, info);
+    writeJournal(dir, file, info);
     free(buf);
     free(bpath);
 }
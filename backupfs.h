@@ -37,39 +37,36 @@
 #ifndef __backupfs_h__
 #define __backupfs_h__
 
+#include <pthread.h>
+#include <stdint.h>
 
 #define PROGNAME "backupfs"
 #define PROGNAME_REMOTE  "backupfs-remote"
 #define PROGNAME_CHKSRC  "backupfs-chksrc"
 #define PROGNAME_MKDIR   "backupfs-mkdir"
-#define PROGNAME_MKLINK  "backupfs-mklink"
 #define PROGNAME_NEWFILE "newfiles"
 #define DEBUG            "DEBUG"   /* env. var. for debugging */
 #define WAITGDB          "WAITGDB" /* env. var. to debug children */
 
 #define JNL_FILE     ".backupfs-journal"
 #define OLD_JNL_FILE "/tmp/.backupfs-old-journal-XXXXXX"
-#define TAR_FILE     "/tmp/backupfs-tar-XXXXXX"
+#define JNL_REC_FILE "/tmp/backupfs-jrec-XXXXXX"
+#define JNL_MAGIC    "BKFSJNL"   /* binary journal (8 bytes with NUL) */
 #define LINK_FILE    "/tmp/backupfs-link-XXXXXX"
+#define LINK_MOVED   "="          /* moved file in link list: "=new\0old\0" */
 #define ID_FILE      ".id_rsa"
 #define BKUP_DIR     "2003/01/02" /* backup directory template */
-#define TAR_SRC      "tar -c -T %s -f -"
-#define TAR_DST      "tar xpf -"
-#define RMT_DIR_FILE "dirs-%s-%s"
-#define RMT_LNK_FILE "links-%s-%s"
-#define RMT_TAR_FILE "tar-%s-%s"
 #define DEFAULT_USER "backupfs"
-#define SSH          "ssh -i %s %s@%s "
+#define SSH_CTL_DIR  "/tmp/backupfs-ssh-XXXXXX"
+#define SSH_CTL_SOCK "ctl"        /* master's socket in SSH_CTL_DIR */
+#define SSH_MASTER   "ssh -i %s -S %s -M -N -f %s@%s"
+#define SSH_EXIT     "ssh -S %s -O exit %s@%s"
+#define SSH          "ssh -i %s -S %s %s@%s "
+#define SSH_DIRECT   "ssh -i %s %s@%s "     /* a connection of its own */
 #define RMT_PASS1_1  SSH "backupfs-chksrc %s"
 #define RMT_PASS1_2  "backupfs-mkdir"
-#define RMT_PASS2    SSH "backupfs-remote %s %s %s %s"
-#define RMT_PASS3_1  SSH "cat %s"
-#define RMT_PASS3_2  "backupfs-mkdir"
-#define RMT_PASS4_1  SSH "cat %s"
-#define RMT_PASS4_2  "backupfs-mklink %s %s"
-#define RMT_PASS5_1  SSH "backupfs-exctar %s %s"
-#define RMT_PASS5_2  TAR_DST
-#define RMT_PASS6    SSH "rm -f %s %s %s"
+#define RMT_PASS2    SSH "backupfs-remote %s%s%s%s %s"
+#define RMT_FETCH    SSH_DIRECT "backupfs-remote -f %s%s %s"
 #define VERSION      "backupfs Version 1.0 Beta 5 ($Revision: 1.29 $)"
 
 
@@ -84,11 +81,132 @@ enum {
     destDirMode = 0755,
     MAXARGS     = 32,           /* max command arguments */
     MAXCHARS    = 1024,         /* max characters per line */
+    maxWalkThreads = 64,        /* max dirwalk() threads by default */
+    linkDirs    = 8,            /* directories kept open per dirwalk() thread */
+    linkBatch   = 256,          /* links queued in io_uring per thread (-u) */
+    statBatch   = 64,           /* entries stat'ed in io_uring at a time (-u) */
+    maxStreams  = 8,            /* remote data streams by default at most */
+    streamBytes = 1 << 28,      /* bytes per remote data stream by default */
+    pipeSize    = 1 << 20,      /* F_SETPIPE_SZ of the remote stream pipes */
+    deltaMinSize = 1 << 24,     /* changed files this large are deltas */
+    jnlVersion  = 4,            /* binary journal format version */
+    jnlSorted   = 0x00000001,   /* jnlHeader.flags: records in path order */
+    jnlStat     = 0x00000002,   /* jnlHeader.flags: size, inode, ns */
 };
 
+/* Records from backupfs-remote to backupfs. See stream.c
+ */
+enum {
+    recTime     = 'T',          /* last backup time */
+    recDir      = 'D',          /* directory */
+    recLink     = 'L',          /* link from the last backup */
+    recFile     = 'F',          /* file attributes and path name */
+    recData     = 'C',          /* contents of the last recFile */
+    recZData    = 'Z',          /* recData compressed with zlib */
+    recSame     = 'H',          /* another name of a file sent */
+    recPrint    = 'P',          /* output of backupfs-remote */
+    recQueue    = 'Q',          /* file to be fetched by another stream */
+    recWait     = 'W',          /* waiting for queued files to be fetched */
+    recEnd      = 'E',          /* end of the stream */
+    recHdrLen   = 9,            /* type + data length in 8 hex digits */
+    recChunk    = 1 << 16,      /* data length of recData read(), recPrint */
+    recMaxLen   = pipeSize,     /* max data length of any record */
+};
+
+
+/* Binary journal file header. See journal.c for the layout.
+ */
+typedef struct {
+    char     magic[8];          /* JNL_MAGIC */
+    uint32_t version;           /* jnlVersion */
+    uint32_t recSize;           /* sizeof(journalEntry) */
+    uint64_t count;             /* # of records */
+    uint64_t strOff;            /* offset of string table */
+    uint64_t strSize;           /* size of string table */
+    uint64_t recOff;            /* offset of records */
+    uint32_t flags;             /* jnlSorted (version 2 and later) */
+    uint32_t reserved;
+    uint64_t dirOff;            /* offset of dir table (version 3) */
+    uint64_t dirCount;          /* # of directories (version 3) */
+} jnlHeader;
+
+/* Fixed width journal record
+ */
+typedef struct {
+    int64_t  ctime;
+    int64_t  mtime;
+    uint32_t dir;               /* index in dir table */
+    uint32_t name;              /* offset of base name in string table */
+    uint32_t ctimeNs;           /* nanoseconds of ctime */
+    uint32_t mtimeNs;           /* nanoseconds of mtime */
+    int64_t  size;
+    uint64_t ino;
+    uint64_t dev;
+} journalEntry;
+
+/* Old journal mapped by makeJournalTree()
+ */
+typedef struct {
+    char*         map;          /* mmap()ed journal file */
+    size_t        mapLen;
+    char*         str;          /* string table */
+    uint64_t      strSize;
+    uint32_t*     dir;          /* dir table */
+    uint64_t      dirCount;     /* # of directories */
+    journalEntry* ent;          /* records */
+    uint64_t      count;        /* # of records */
+    uint32_t      flags;        /* jnlHeader.flags */
+    uint64_t      cur;          /* next record for matchJournal() */
+    uint32_t*     slot;         /* record index: record # + 1 (0: empty) */
+    uint64_t      mask;         /* # of slots - 1 */
+    uint32_t*     inoSlot;      /* record index by inode (jnlStat only) */
+    uint64_t      inoMask;      /* # of inode slots - 1 */
+    int           entAlloc;     /* `ent' is malloc()ed (old journal) */
+    int           dirAlloc;     /* `dir' is malloc()ed (old journal) */
+} jnlImage;
+
+/* New journal being written
+ */
+typedef struct {
+    FILE*    rec;               /* records (temporary file) */
+    char*    rpath;             /* temporary file path name */
+    uint64_t count;             /* # of records */
+    uint64_t strSize;           /* size of string table written so far */
+    void*    dirs;              /* directory path name -> index + 1 */
+    uint32_t* dir;              /* dir table */
+    uint64_t dirCount;          /* # of directories */
+    uint64_t dirMax;            /* size of `dir' */
+    char*    last;              /* last path name written */
+    size_t   lastSize;          /* size of `last' buffer */
+    int      unsorted;          /* records are not in path order */
+} jnlWriter;
+
+
+/* Source files with more than one link seen by dirwalk(): the
+   first name of each inode decides how it is backed up and the
+   other names follow it. See firstLink().
+ */
+typedef struct {
+    void*           map;        /* "dev:ino" -> state of the inode */
+    pthread_mutex_t lock;
+    pthread_cond_t  decided;    /* the first name was backed up */
+} linkMap;
 
+enum {
+    linkNone = 0,               /* inode not tracked */
+    linkFirst,                  /* first name: back it up as usual */
+    linkCopied,                 /* first name was copied */
+    linkLinked,                 /* first name was linked from the last backup */
+};
+
+typedef struct _copyPool copyPool;
+typedef struct _dirCache dirCache;
+typedef struct _uring uring;
+typedef void (*linkFailed)(char* src, char* dest, int err, void* arg);
+typedef int (*dirOpener)(char* path, void* arg);
 typedef struct _bkupInfo* pbkupInfo;
 typedef void (*pMakeCmd)(char* dir, char* file, pbkupInfo pInfo);
+typedef int (*pReader)(FILE* fp, pbkupInfo pInfo);
 
 typedef struct _bkupInfo {
     char*    dest;              /* backup destination root */
@@ -98,9 +216,12 @@ typedef struct _bkupInfo {
     FILE*    jnl;               /* new journal file */
     char*    jpath;             /* new journal file path name */
     char*    oldJpath;          /* old journal file path name */
-    void*    jt;                /* journal tree */
-    FILE*    tar;               /* tar input file */
-    char*    tpath;             /* tar input file path name */
+    void*    jt;                /* journal tree: directory -> index + 1 */
+    jnlImage* ojnl;             /* old journal */
+    jnlWriter* jw;              /* new journal writer */
+    copyPool* copy;             /* copy threads (local backup) */
+    linkMap* hardLinks;         /* source hard links during dirwalk() */
+    dirCache* dirs;             /* directories of makeLink() (per thread) */
     char*    bdir;              /* backup directory */
     int      blen;              /* length of bdir */
     char*    lbdir;             /* last backup directory */
@@ -109,21 +230,21 @@ typedef struct _bkupInfo {
     time_t   ctime;             /* current file ctime */
     time_t   mtime;             /* current file mtime */
     char*    sshid;             /* ssh secret key (id) file path name */
-    char*    ndpath;            /* new directories info file in remote host */
-    FILE*    newdirs;           /* new directories in remote host */
-    char*    linkpath;          /* hard link info file in remote host */
-    FILE*    links;
+    char*    sshctl;            /* ssh master's control socket path name */
+    FILE*    stream;            /* records to backupfs (remote host) */
     struct stat* stbuf;         /* for newfiles and changedfiles */
+    int      nthreads;          /* # of dirwalk() threads (0: # of CPUs) */
+    int      sorted;            /* dirwalk() in path order, merge journal */
+    int      uring;             /* batch stat and link with io_uring (-u) */
+    int      hdd;               /* read in the order on the disk (-H) */
+    int      streams;           /* remote data streams (0: automatic) */
+    int      listOnly;          /* queue files instead of sending them */
+    int      ackfd;             /* tells backupfs-remote -l files are fetched */
+    char*    store;             /* content store directory (NULL: none) */
+    pthread_mutex_t* lock;      /* serializes output during dirwalk() */
 } bkupInfo;
 
 
-typedef struct {
-    time_t ctime;
-    time_t mtime;
-    char*  path;
-} journalEntry;
-
-
 typedef struct {
     struct sigaction ignore;
     struct sigaction svIntr;
@@ -152,6 +273,9 @@ extern char CompilationDate[];
 void     backupfsExit(bkupInfo* info, int exitStatus);
 
 int      dirwalk(char* dir, bkupInfo* pInfo);
+int      walkThreads(bkupInfo* info);
+int      firstLink(char** lspath, bkupInfo* info);
+void     setFirstLink(char* lspath, bkupInfo* info);
 
 bkupType chkSource(bkupInfo* info);
 void     chkDest(bkupInfo* info);
@@ -160,20 +284,55 @@ void     recurrentBackup(char* dir, char* file, bkupInfo* info);
 
 FILE*      makeTemp(char* path, char* mode);
 int        getPathMode(char* path, mode_t* mode);
+uint64_t   diskOrder(char* path);
 void       openFilesLocal(bkupInfo* info);
-void       openFilesRemote(bkupInfo* info);
 void       closeFilesLocal(bkupInfo* info);
 void       closeFiles(bkupInfo* info);
-void       removeFiles(bkupInfo* info);
 int        moveFile(char* from, char* to);      
 int        isDirEmpty(char* dir);
 int        makeJournalTree(bkupInfo* info);
-int        runCommands(bkupInfo* info);
+int        openJournal(bkupInfo* info);
+void       writeJournal(char* dir, char* file, bkupInfo* info);
+int        closeJournal(bkupInfo* info);
+void       freeJournalTree(bkupInfo* info);
+journalEntry* findJournal(char* dir, char* file, bkupInfo* info);
+journalEntry* matchJournal(char* dir, char* file, bkupInfo* info);
+journalEntry* findMoved(char** dir, char** file, bkupInfo* info);
+int        isUnchanged(journalEntry* ent, bkupInfo* info);
+int        isAppended(journalEntry* ent, bkupInfo* info);
+int        copyStart(bkupInfo* info);
+void       backupFile(char* path, char* last, off_t size, bkupInfo* info);
+int        copyFinish(bkupInfo* info);
+dirCache*  dirCacheNew(int nent);
+void       dirCacheFree(dirCache* dc);
+int        dirCacheLink(char* src, char* dest, dirCache* dc);
+int        dirCacheRing(dirCache* dc, linkFailed func, void* arg);
+void       dirCacheOpener(dirCache* dc, dirOpener func, void* arg);
+int        dirCacheDir(dirCache* dc, char* path, char** base);
+void       dirCacheFlush(dirCache* dc);
+uring*     uringOpen(unsigned entries);
+void       uringClose(uring* r);
+unsigned   uringSpace(uring* r);
+int        uringLinkat(uring* r, int ofd, char* old, int nfd, char* new,
+                       uint64_t data);
+int        uringSubmit(uring* r, unsigned wait);
+int        uringReap(uring* r, uint64_t* data, int* res);
+void       uringStat(uring* r, int dfd, char** name, int n, struct stat* st,
+                     int* ok, int dontSync);
+int        statAt(int dfd, char* name, struct stat* st, int dontSync);
+int        storeOpen(bkupInfo* info);
+int        storeLink(char* path, char* dst, struct stat* st, uint64_t* key,
+                     bkupInfo* info);
+void       storeAdd(char* dst, uint64_t key, bkupInfo* info);
+void       storeTree(bkupInfo* info);
 pipeExitSt execCommands(char* cmd1, char* cmd2);
+pipeExitSt execReader(char* cmd, pReader reader, int in, bkupInfo* info,
+                      int* rv);
 int        chkCmdExitSt(pipeExitSt st, char* cmd);
 int        chkPipeExitSt(pipeExitSt st, char* cmd1, char* cmd2);
 
 void       makeSshKey(bkupInfo* info);
+void       openSshMaster(bkupInfo* info);
 int        chkRemoteSrc(bkupInfo* info);
 int        lastBkupDirFromTime(time_t mtime, bkupInfo* info);
 int        getLastBkupDir(bkupInfo* info);
@@ -181,6 +340,16 @@ int        doRemote(bkupInfo* info);
 int        newDirectory(char* bkupdir, struct stat* pstat, bkupInfo* info);
 int        makeLink(char* src, char* dest, bkupInfo* info);
 void       writeDestDir(bkupInfo* info);
+void       sendStart(bkupInfo* info);
+void       sendFinish(bkupInfo* info);
+void       fetchFiles(FILE* fp, bkupInfo* info);
+void       openStream(bkupInfo* info);
+void       closeStream(bkupInfo* info);
+void       putRecord(int type, char* s, size_t len, bkupInfo* info);
+int        putFile(char* path, bkupInfo* info);
+void       freeSentFiles(void);
+int        recvStream(FILE* in, bkupInfo* info);
+int        makeNewDir(char* rec);
 void       openJournalFile (bkupInfo* info);
 
 
@@ -222,6 +391,22 @@ fwriteExit (char* s, FILE* fp, char* file, bkupInfo* info)
     }
 }
 
+/* dirwalk() calls info->func and newDirectory() from several
+   threads. Writes to the shared files (journal, etc.)
+   must be done between lockOutput() and unlockOutput().
+ */
+static inline void
+lockOutput (bkupInfo* info)
+{
+    if (info->lock) pthread_mutex_lock(info->lock);
+}
+
+static inline void
+unlockOutput (bkupInfo* info)
+{
+    if (info->lock) pthread_mutex_unlock(info->lock);
+}
+
 static inline int
 isIllegalCmdID (int i)
 {
@@ -0,0 +1,799 @@
+/* $Id$
+
+   copy.c: copying new and changed files to the backup directory
+
+
+   Copyright (c) 2026, Yoichi Hariguchi
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+       o Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+       o Redistributions in binary form must reproduce the above
+         copyright notice, this list of conditions and the following
+         disclaimer in the documentation and/or other materials provided
+         with the distribution.
+       o Neither the name of the Yoichi Hariguchi nor the names of its
+         contributors may be used to endorse or promote products derived
+         from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#endif
+
+#include "string-rbt.h"
+#include "backupfs.h"
+#include "error.h"
+
+
+/* Local backups copy new and changed files while dirwalk() is
+   still running: backupFile() puts each path name into a bounded
+   queue and a pool of threads started by copyStart() copies the
+   files to info->bdir with their owner, mode and times. A file
+   which only grew since the last backup is a clone of the last
+   backup plus the appended bytes if the file system can. A large
+   file is a clone of the last backup with only the changed blocks
+   written over it. Files with
+   more than one link are linked to the first copy, as tar does;
+   copyFinish() makes these links after all copies are done.
+   With -H, path names are queued diskBatch at a time in the
+   order of their data on the disk.
+ */
+
+enum {
+    copyChunk = 1 << 30,        /* max bytes per copy_file_range() */
+    copyBufSize = 1 << 17,      /* read()/write() buffer */
+    copyQueueSize = 4096,       /* max path names waiting for copy */
+    copyTailSize = 4096,        /* bytes compared before appending */
+    deltaBlockSize = 4096,      /* unit of comparison and rewrite */
+    diskBatch = 1024,           /* files sorted by diskOrder() (-H) */
+};
+
+/* A file to copy
+ */
+typedef struct {
+    char* path;                 /* source path name */
+    char* last;                 /* last backup of `path' */
+    off_t size;                 /* size of `last' if `path' grew, or 0 */
+    uint64_t key;               /* diskOrder() of `path' (-H) */
+} copyJob;
+
+/* A hard link to be made after the copies
+ */
+typedef struct _copyLink {
+    struct _copyLink* next;
+    char*             src;      /* backup path of the first copy */
+    char*             dst;      /* backup path of this link */
+    char*             path;     /* source path name */
+} copyLink;
+
+struct _copyPool {
+    pthread_mutex_t lock;       /* protects all below */
+    pthread_cond_t  notEmpty;
+    pthread_cond_t  notFull;
+    pthread_cond_t  batchDone;  /* `batch' was queued */
+    copyJob*  queue[copyQueueSize]; /* files to copy */
+    int       head;             /* next path name to copy */
+    int       count;            /* # of path names in `queue' */
+    int       closed;           /* no more path names */
+    bkupInfo* info;
+    void*     inodes;           /* "dev:ino" -> backup path (st_nlink > 1) */
+    copyLink* links;            /* deferred hard links */
+    copyJob*  journal;          /* info->jpath, copied when it is closed */
+    copyJob*  batch[diskBatch]; /* -H: files to be sorted and queued */
+    int       nbatch;           /* # of files in `batch' */
+    int       failed;           /* # of files not copied */
+    int       nthreads;         /* # of running copy threads */
+    pthread_t tid[maxWalkThreads];
+};
+
+
+/* Copy the data of `in' to `out'. Share the extents with
+   ioctl(FICLONE) if both are on the same file system which
+   supports reflinks (btrfs, XFS, ...) and `clone' is set.
+   Otherwise use copy_file_range() or sendfile() if the kernel
+   can, or read() and write(). Copy from the current offsets.
+   Return 1 if success, 0 otherwise.
+ */
+static int
+copyData (int in, int out, char* path, int clone)
+{
+    char*   buf;
+    char*   p;
+    ssize_t n;
+    ssize_t w;
+
+
+#ifdef __linux__
+#ifdef FICLONE
+    /* A failed clone leaves `out' empty; copy the bytes instead.
+     */
+    if (clone && ioctl(out, FICLONE, in) == 0) return 1;
+#endif
+    n = copy_file_range(in, NULL, out, NULL, copyChunk, 0);
+    if (n >= 0) {
+        while (n > 0) {
+            n = copy_file_range(in, NULL, out, NULL, copyChunk, 0);
+        }
+        if (n == 0) return 1;
+    }
+    if (errno != EXDEV && errno != ENOSYS && errno != EINVAL &&
+        errno != EOPNOTSUPP) {
+        errSysRet(("copy_file_range(%s)", path));
+        return 0;
+    }
+    n = sendfile(out, in, NULL, copyChunk);
+    if (n >= 0) {
+        while (n > 0) {
+            n = sendfile(out, in, NULL, copyChunk);
+        }
+        if (n == 0) return 1;
+    }
+    if (errno != EINVAL && errno != ENOSYS) {
+        errSysRet(("sendfile(%s)", path));
+        return 0;
+    }
+#endif
+
+    buf = malloc(copyBufSize);
+    if (!buf) {
+        errSysRet(("malloc(%d)", copyBufSize));
+        return 0;
+    }
+    while ((n = read(in, buf, copyBufSize)) > 0) {
+        for (p = buf; n > 0; p += w, n -= w) {
+            w = write(out, p, n);
+            if (w < 0) {
+                errSysRet(("write(%s)", path));
+                free(buf);
+                return 0;
+            }
+        }
+    }
+    if (n < 0) errSysRet(("read(%s)", path));
+    free(buf);
+    return n == 0;
+}
+
+
+/* Set the owner, mode and times of `out' (`dst') to `st'.
+   Return 1 if success, 0 otherwise.
+ */
+static int
+copyAttr (int out, char* dst, struct stat* st)
+{
+    struct timespec ts[2];
+
+
+    /* chown() first: it may clear set-user-ID and set-group-ID.
+     */
+    if (fchown(out, st->st_uid, st->st_gid)) {
+        errSysRet(("fchown(%s, 0x%08x, 0x%08x)", dst, st->st_uid, st->st_gid));
+        return 0;
+    }
+    if (fchmod(out, st->st_mode & 07777)) {
+        errSysRet(("fchmod(%s)", dst));
+        return 0;
+    }
+    ts[0] = st->st_atim;
+    ts[1] = st->st_mtim;
+    if (futimens(out, ts)) {
+        errSysRet(("futimens(%s)", dst));
+        return 0;
+    }
+    return 1;
+}
+
+
+/* Copy regular file `path' to `dst'.
+   Return 1 if success, 0 otherwise.
+ */
+static int
+copyRegular (char* path, char* dst, struct stat* st)
+{
+    int in;
+    int out;
+    int rv = 0;
+
+
+    in = open(path, O_RDONLY|O_NOFOLLOW);
+    if (in < 0) {
+        errSysRet(("open(%s)", path));
+        return 0;
+    }
+    out = open(dst, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW, S_IRUSR|S_IWUSR);
+    if (out < 0) {
+        errSysRet(("open(%s)", dst));
+        close(in);
+        return 0;
+    }
+    if (!copyData(in, out, path, 1)) goto closeReturn;
+    if (!copyAttr(out, dst, st)) goto closeReturn;
+    rv = 1;
+
+closeReturn:
+    if (close(out)) {
+        errSysRet(("close(%s)", dst));
+        rv = 0;
+    }
+    close(in);
+    return rv;
+}
+
+
+/* Make `dst' a clone of job->last, the last backup of job->path,
+   and append the bytes written to job->path since then. Check
+   the last copyTailSize bytes of job->last first.
+   Return 1 if success, 0 if job->path must be copied as a whole.
+ */
+static int
+copyAppend (copyJob* job, char* dst, struct stat* st)
+{
+#ifdef FICLONE
+    struct stat lstbuf;
+    char        a[copyTailSize];
+    char        b[copyTailSize];
+    ssize_t     len;
+    int         in;
+    int         last;
+    int         out = -1;
+    int         rv = 0;
+
+
+    in = open(job->path, O_RDONLY|O_NOFOLLOW);
+    if (in < 0) return 0;
+    last = open(job->last, O_RDONLY|O_NOFOLLOW);
+    if (last < 0) goto closeReturn;
+    if (fstat(last, &lstbuf) || lstbuf.st_size != job->size) goto closeReturn;
+
+    len = job->size < copyTailSize ? job->size : copyTailSize;
+    if (pread(in, a, len, job->size - len) != len) goto closeReturn;
+    if (pread(last, b, len, job->size - len) != len) goto closeReturn;
+    if (memcmp(a, b, len)) goto closeReturn;
+
+    out = open(dst, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW, S_IRUSR|S_IWUSR);
+    if (out < 0) goto closeReturn;
+    if (ioctl(out, FICLONE, last)) goto closeReturn;
+    if (lseek(in, job->size, SEEK_SET) != job->size) goto closeReturn;
+    if (lseek(out, job->size, SEEK_SET) != job->size) goto closeReturn;
+    if (!copyData(in, out, job->path, 0)) goto closeReturn;
+    rv = copyAttr(out, dst, st);
+
+closeReturn:
+    if (out >= 0) {
+        if (close(out)) rv = 0;
+        if (!rv && unlink(dst)) errSysRet(("unlink(%s)", dst));
+    }
+    if (last >= 0) close(last);
+    close(in);
+    return rv;
+#else
+    return 0;
+#endif
+}
+
+
+/* Write the blocks of `in' different from those of `last' to
+   `out' at the same offsets, and the blocks beyond the end of
+   `last'. `out' must be a clone of `last'.
+   Return 1 if success, 0 otherwise.
+ */
+static int
+writeDelta (int in, int last, int out, char* a, char* b)
+{
+    ssize_t n;
+    ssize_t m;
+    ssize_t i;
+    ssize_t len;
+    ssize_t start;              /* first changed block of a run */
+    off_t   off;
+    int     same;
+
+
+    for (off = 0; (n = pread(in, a, copyBufSize, off)) > 0; off += n) {
+        m = pread(last, b, n, off);
+        if (m < 0) return 0;
+        start = -1;
+        for (i = 0; ; i += deltaBlockSize) {
+            if (i >= n) {
+                i = n;
+                same = 1;       /* flush the last run */
+            } else {
+                len = n - i < deltaBlockSize ? n - i : deltaBlockSize;
+                same = i + len <= m && !memcmp(a + i, b + i, len);
+            }
+            if (!same && start < 0) start = i;
+            if (same && start >= 0) {
+                if (pwrite(out, a + start, i - start, off + start) !=
+                    i - start) {
+                    return 0;
+                }
+                start = -1;
+            }
+            if (i == n) break;
+        }
+    }
+    return n == 0;
+}
+
+
+/* Make `dst' a clone of job->last, the last backup of job->path,
+   and write the blocks of job->path which differ from job->last.
+   Return 1 if success, 0 if job->path must be copied as a whole.
+ */
+static int
+copyDelta (copyJob* job, char* dst, struct stat* st)
+{
+#ifdef FICLONE
+    struct stat lstbuf;
+    char*       buf;
+    int         in;
+    int         last;
+    int         out = -1;
+    int         rv = 0;
+
+
+    buf = malloc(2 * copyBufSize);
+    if (!buf) return 0;
+    in = open(job->path, O_RDONLY|O_NOFOLLOW);
+    if (in < 0) goto freeReturn;
+    last = open(job->last, O_RDONLY|O_NOFOLLOW);
+    if (last < 0) goto closeReturn;
+    if (fstat(last, &lstbuf) || !S_ISREG(lstbuf.st_mode)) goto closeReturn;
+
+    out = open(dst, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW, S_IRUSR|S_IWUSR);
+    if (out < 0) goto closeReturn;
+    if (ioctl(out, FICLONE, last)) goto closeReturn;
+    if (lstbuf.st_size > st->st_size && ftruncate(out, st->st_size)) {
+        errSysRet(("ftruncate(%s)", dst));
+        goto closeReturn;
+    }
+    if (!writeDelta(in, last, out, buf, buf + copyBufSize)) {
+        errSysRet(("%s: delta of %s", job->path, job->last));
+        goto closeReturn;
+    }
+    rv = copyAttr(out, dst, st);
+
+closeReturn:
+    if (out >= 0) {
+        if (close(out)) rv = 0;
+        if (!rv && unlink(dst)) errSysRet(("unlink(%s)", dst));
+    }
+    if (last >= 0) close(last);
+    close(in);
+freeReturn:
+    free(buf);
+    return rv;
+#else
+    return 0;
+#endif
+}
+
+
+/* Link regular file `path' to `dst' from the content store
+   if it is there. Otherwise copy it and add it to the store.
+   Return 1 if success, 0 otherwise.
+ */
+static int
+copyStored (char* path, char* dst, struct stat* st, bkupInfo* info)
+{
+    uint64_t key;
+
+
+    if (!info->store || st->st_size == 0) return copyRegular(path, dst, st);
+    if (storeLink(path, dst, st, &key, info)) return 1;
+    if (!copyRegular(path, dst, st)) return 0;
+    if (key) storeAdd(dst, key, info);
+    return 1;
+}
+
+
+/* Copy symbolic link `path' to `dst'.
+   Return 1 if success, 0 otherwise.
+ */
+static int
+copySymlink (char* path, char* dst, struct stat* st)
+{
+    struct timespec ts[2];
+    char*           target;
+    ssize_t         len;
+    int             rv = 0;
+
+
+    target = malloc(st->st_size + 1);
+    if (!target) {
+        errSysRet(("malloc(%d)", (int)st->st_size + 1));
+        return 0;
+    }
+    len = readlink(path, target, st->st_size + 1);
+    if (len < 0 || len > st->st_size) {
+        errSysRet(("readlink(%s)", path));
+        goto freeReturn;
+    }
+    target[len] = '\0';
+    if (symlink(target, dst)) {
+        errSysRet(("symlink(%s, %s)", target, dst));
+        goto freeReturn;
+    }
+    if (lchown(dst, st->st_uid, st->st_gid)) {
+        errSysRet(("lchown(%s, 0x%08x, 0x%08x)", dst, st->st_uid, st->st_gid));
+        goto freeReturn;
+    }
+    ts[0] = st->st_atim;
+    ts[1] = st->st_mtim;
+    if (utimensat(AT_FDCWD, dst, ts, AT_SYMLINK_NOFOLLOW)) {
+        errSysRet(("utimensat(%s)", dst));
+        goto freeReturn;
+    }
+    rv = 1;
+
+freeReturn:
+    free(target);
+    return rv;
+}
+
+
+/* Copy job->path to info->bdir, or defer it if it is a hard link
+   to a file already copied.
+   Return 1 if success, 0 otherwise.
+ */
+static int
+copyOne (copyJob* job, copyPool* pool)
+{
+    struct stat stbuf;
+    copyLink*   lnk;
+    char        key[40];
+    char*       path = job->path;
+    char*       dst;
+    char*       first;
+    int         rv = 0;
+
+
+    dst = malloc(pool->info->blen + strlen(path) + 1);
+    if (!dst) {
+        errSysRet(("malloc(%s%s)", pool->info->bdir, path));
+        return 0;
+    }
+    strcpy(dst, pool->info->bdir);
+    strcat(dst, path);          /* "/" no need since path is absolute */
+
+    if (lstat(path, &stbuf)) {
+        errSysRet(("lstat(%s)", path));
+        goto freeReturn;
+    }
+    if (unlink(dst) && errno != ENOENT) {
+        errSysRet(("unlink(%s)", dst));
+        goto freeReturn;
+    }
+
+    if (stbuf.st_nlink > 1 && !S_ISDIR(stbuf.st_mode)) {
+        snprintf(key, sizeof(key), "%llx:%llx",
+                 (unsigned long long)stbuf.st_dev,
+                 (unsigned long long)stbuf.st_ino);
+        pthread_mutex_lock(&pool->lock);
+        first = stringRBTfind(pool->inodes, key);
+        if (first) {
+            lnk = malloc(sizeof(*lnk));
+            if (lnk) {
+                lnk->src  = first;
+                lnk->dst  = dst;
+                lnk->path = strdup(path);
+                lnk->next = pool->links;
+                pool->links = lnk;
+            }
+            pthread_mutex_unlock(&pool->lock);
+            if (!lnk || !lnk->path) {
+                errSysRet(("malloc(%s)", path));
+                return 0;
+            }
+            return 1;           /* `dst' is owned by `lnk' */
+        }
+        first = strdup(dst);
+        if (!first || stringRBTinsert(pool->inodes, key, first)) {
+            errRet(("can't remember %s", dst));
+            free(first);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    switch (stbuf.st_mode & S_IFMT) {
+    case S_IFREG:
+        rv = (job->last && job->size && copyAppend(job, dst, &stbuf)) ||
+             (job->last && stbuf.st_size >= deltaMinSize &&
+              copyDelta(job, dst, &stbuf)) ||
+             copyStored(path, dst, &stbuf, pool->info);
+        break;
+    case S_IFLNK:
+        rv = copySymlink(path, dst, &stbuf);
+        break;
+    default:
+        errRet(("%s: not a regular file nor a symbolic link", path));
+        break;
+    }
+
+freeReturn:
+    free(dst);
+    return rv;
+}
+
+
+static void*
+copyWorkerMain (void* arg)
+{
+    copyPool* pool = arg;
+    copyJob*  job;
+
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->count == 0 && !pool->closed) {
+            pthread_cond_wait(&pool->notEmpty, &pool->lock);
+        }
+        if (pool->count == 0) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        job = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % copyQueueSize;
+        --pool->count;
+        pthread_cond_signal(&pool->notFull);
+        pthread_mutex_unlock(&pool->lock);
+
+        if (!copyOne(job, pool)) {
+            pthread_mutex_lock(&pool->lock);
+            ++pool->failed;
+            pthread_mutex_unlock(&pool->lock);
+        }
+        free(job);
+    }
+    return NULL;
+}
+
+
+static void
+freeInode (const char* key, void* val, void* arg)
+{
+    free(val);
+}
+
+
+/* Start walkThreads(info) copy threads.
+   Return 1 if success, 0 otherwise.
+ */
+int
+copyStart (bkupInfo* info)
+{
+    copyPool* pool;
+    int       nthreads;
+
+
+    assert(info);
+    assert(info->bdir);
+
+    pool = calloc(1, sizeof(*pool));
+    if (!pool) {
+        errSysRet(("calloc(copyPool)"));
+        return 0;
+    }
+    pool->inodes = stringRBTcreate();
+    if (!pool->inodes) {
+        errRet(("stringRBTcreate() failed"));
+        free(pool);
+        return 0;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->notEmpty, NULL);
+    pthread_cond_init(&pool->notFull, NULL);
+    pthread_cond_init(&pool->batchDone, NULL);
+    pool->info = info;
+
+    nthreads = walkThreads(info);
+    if (nthreads > maxWalkThreads) nthreads = maxWalkThreads;
+    for (; pool->nthreads < nthreads; ++pool->nthreads) {
+        if (pthread_create(&pool->tid[pool->nthreads], NULL,
+                           copyWorkerMain, pool)) {
+            errSysRet(("pthread_create(copy %d)", pool->nthreads));
+            break;
+        }
+    }
+    if (pool->nthreads == 0) {
+        stringRBTdestroy(pool->inodes);
+        free(pool);
+        return 0;
+    }
+    info->copy = pool;
+    return 1;
+}
+
+
+/* Put `p' in the queue. Wait if the queue is full.
+   pool->lock must be held.
+ */
+static void
+queueJob (copyPool* pool, copyJob* p)
+{
+    while (pool->count == copyQueueSize) {
+        pthread_cond_wait(&pool->notFull, &pool->lock);
+    }
+    pool->queue[(pool->head + pool->count) % copyQueueSize] = p;
+    ++pool->count;
+    pthread_cond_signal(&pool->notEmpty);
+}
+
+
+static int
+jobCmp (const void* a, const void* b)
+{
+    uint64_t ka = (*(copyJob* const*)a)->key;
+    uint64_t kb = (*(copyJob* const*)b)->key;
+
+
+    return (ka > kb) - (ka < kb);
+}
+
+
+/* Queue the files in pool->batch in diskOrder(). The batch
+   stays full until all of them are queued, so that other
+   threads wait for batchDone. pool->lock must be held.
+ */
+static void
+queueBatch (copyPool* pool)
+{
+    int i;
+
+
+    qsort(pool->batch, pool->nbatch, sizeof(*pool->batch), jobCmp);
+    for (i = 0; i < pool->nbatch; ++i) {
+        queueJob(pool, pool->batch[i]);
+    }
+    pool->nbatch = 0;
+    pthread_cond_broadcast(&pool->batchDone);
+}
+
+
+/* Queue `path' for copy. If `last' is not NULL, it is the last
+   backup of `path'. If `size' is not 0, `last' was `size' bytes
+   long and `path' may only have grown since then. Wait if the
+   queue is full.
+ */
+void
+backupFile (char* path, char* last, off_t size, bkupInfo* info)
+{
+    copyPool* pool;
+    copyJob*  p;
+    int       plen;
+    int       llen;
+
+
+    assert(path);
+    assert(info);
+    assert(info->copy);
+
+    pool = info->copy;
+    plen = strlen(path) + 1;
+    llen = last ? strlen(last) + 1 : 0;
+    p = malloc(sizeof(*p) + plen + llen);
+    if (!p) {
+        errSysRet(("malloc(%s)", path));
+        backupfsExit(info, 1);
+    }
+    p->path = memcpy(p + 1, path, plen);
+    p->last = last ? memcpy(p->path + plen, last, llen) : NULL;
+    p->size = size;
+    p->key  = info->hdd ? diskOrder(path) : 0;
+    pthread_mutex_lock(&pool->lock);
+    if (info->jpath && !strcmp(path, info->jpath)) {
+        /* The journal is still being written
+         */
+        pool->journal = p;
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+    if (info->hdd) {
+        while (pool->nbatch == diskBatch) {
+            pthread_cond_wait(&pool->batchDone, &pool->lock);
+        }
+        pool->batch[pool->nbatch++] = p;
+        if (pool->nbatch == diskBatch) queueBatch(pool);
+    } else {
+        queueJob(pool, p);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/* Wait for the copy threads to copy all the queued files and
+   make the deferred hard links. The journal must be closed.
+   Return 1 if all the files were copied, 0 otherwise.
+ */
+int
+copyFinish (bkupInfo* info)
+{
+    copyPool*   pool;
+    copyLink*   lnk;
+    struct stat stbuf;
+    int         i;
+
+
+    assert(info);
+
+    pool = info->copy;
+    if (!pool) return 0;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->nbatch) queueBatch(pool);
+    pool->closed = 1;
+    pthread_cond_broadcast(&pool->notEmpty);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->nthreads; ++i) {
+        pthread_join(pool->tid[i], NULL);
+    }
+    if (pool->journal) {
+        if (!copyOne(pool->journal, pool)) ++pool->failed;
+        free(pool->journal);
+    }
+
+    /* Hard links to files copied above
+     */
+    while ((lnk = pool->links)) {
+        pool->links = lnk->next;
+        if (link(lnk->src, lnk->dst)) {
+            errSysRet(("link(%s, %s)", lnk->src, lnk->dst));
+            if (lstat(lnk->path, &stbuf) ||
+                !S_ISREG(stbuf.st_mode) ||
+                !copyRegular(lnk->path, lnk->dst, &stbuf)) {
+                ++pool->failed;
+            }
+        }
+        free(lnk->dst);
+        free(lnk->path);
+        free(lnk);
+    }
+    stringRBTwalk(pool->inodes, freeInode, NULL);
+    stringRBTdestroy(pool->inodes);
+    pthread_cond_destroy(&pool->batchDone);
+    pthread_cond_destroy(&pool->notFull);
+    pthread_cond_destroy(&pool->notEmpty);
+    pthread_mutex_destroy(&pool->lock);
+    info->copy = NULL;
+
+    i = pool->failed;
+    free(pool);
+    if (i) {
+        errRet(("%d files not copied", i));
+        return 0;
+    }
+    return 1;
+}
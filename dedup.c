@@ -0,0 +1,409 @@
+/* $Id$
+
+   dedup.c: content store shared by backups
+
+
+   Copyright (c) 2026, Yoichi Hariguchi
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+       o Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+       o Redistributions in binary form must reproduce the above
+         copyright notice, this list of conditions and the following
+         disclaimer in the documentation and/or other materials provided
+         with the distribution.
+       o Neither the name of the Yoichi Hariguchi nor the names of its
+         contributors may be used to endorse or promote products derived
+         from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "backupfs.h"
+#include "error.h"
+
+
+/* The content store (info->store) holds one hard link to each
+   distinct backed-up file:
+
+       store/xx/xxxxxxxxxxxxxxxx.n
+
+   where xx... is storeKey() of the content and the owner, group,
+   mode and mtime of the file, and n tells apart files with the same
+   key and copies made because the link count reached its limit
+   (EMLINK). A file to be backed up is linked to a store file with
+   the same key only if both the attributes and the bytes are the
+   same. The store must be in the same file system as the backups.
+   Store files with a link count of 1 are no longer in any backup.
+ */
+
+enum {
+    storeBufSize = 1 << 17,     /* read() buffer */
+    storeMaxSlot = 1000,        /* max n of store/xx/key.n */
+};
+
+
+static inline uint64_t
+storeMix (uint64_t h, uint64_t v)
+{
+    h ^= v * 0x9e3779b97f4a7c15ULL;
+    h = (h << 31) | (h >> 33);
+    return h * 0xc2b2ae3d27d4eb4fULL;
+}
+
+
+/* Hash the contents of `fd' and the attributes in `st' to *key.
+   Return 1 if success, 0 otherwise.
+ */
+static int
+storeKey (int fd, struct stat* st, uint64_t* key, char* path)
+{
+    uint64_t* buf;
+    uint64_t  h[4] = { 1, 2, 3, 4 };
+    uint64_t  w;
+    ssize_t   n;
+    ssize_t   i;
+
+
+    buf = malloc(storeBufSize);
+    if (!buf) {
+        errSysRet(("malloc(%d)", storeBufSize));
+        return 0;
+    }
+    while ((n = read(fd, buf, storeBufSize)) > 0) {
+        for (i = 0; i + 32 <= n; i += 32) {
+            h[0] = storeMix(h[0], buf[i / 8]);
+            h[1] = storeMix(h[1], buf[i / 8 + 1]);
+            h[2] = storeMix(h[2], buf[i / 8 + 2]);
+            h[3] = storeMix(h[3], buf[i / 8 + 3]);
+        }
+        for (; i < n; i += 8) {
+            w = 0;
+            memcpy(&w, (char*)buf + i, n - i < 8 ? n - i : 8);
+            h[0] = storeMix(h[0], w);
+        }
+    }
+    free(buf);
+    if (n < 0) {
+        errSysRet(("read(%s)", path));
+        return 0;
+    }
+    h[0] = storeMix(h[0], h[1]);
+    h[0] = storeMix(h[0], h[2]);
+    h[0] = storeMix(h[0], h[3]);
+    h[0] = storeMix(h[0], st->st_size);
+    h[0] = storeMix(h[0], ((uint64_t)st->st_uid << 32) | st->st_gid);
+    h[0] = storeMix(h[0], st->st_mode);
+    h[0] = storeMix(h[0], st->st_mtim.tv_sec);
+    h[0] = storeMix(h[0], st->st_mtim.tv_nsec);
+    *key = h[0];
+    return 1;
+}
+
+
+/* Return "store/xx/key.n" in malloc()ed memory, NULL if error
+ */
+static char*
+storePath (uint64_t key, int n, bkupInfo* info)
+{
+    char* path;
+    int   len;
+
+
+    len = strlen(info->store) + 32;
+    path = malloc(len);
+    if (!path) {
+        errSysRet(("malloc(%s)", info->store));
+        return NULL;
+    }
+    snprintf(path, len, "%s/%02x/%016llx.%d", info->store,
+             (int)(key >> 56), (unsigned long long)key, n);
+    return path;
+}
+
+
+/* Return 1 if `fd' and the store file `path' have the same
+   attributes and bytes, 0 otherwise.
+ */
+static int
+storeSame (int fd, struct stat* st, char* path)
+{
+    struct stat sst;
+    char*       a;
+    char*       b;
+    ssize_t     n;
+    ssize_t     m;
+    off_t       off;
+    int         sfd;
+    int         rv = 0;
+
+
+    if (lstat(path, &sst)) return 0;
+    if (!S_ISREG(sst.st_mode) ||
+        sst.st_size != st->st_size ||
+        sst.st_uid  != st->st_uid ||
+        sst.st_gid  != st->st_gid ||
+        sst.st_mode != st->st_mode ||
+        sst.st_mtim.tv_sec  != st->st_mtim.tv_sec ||
+        sst.st_mtim.tv_nsec != st->st_mtim.tv_nsec) {
+        return 0;
+    }
+    sfd = open(path, O_RDONLY|O_NOFOLLOW);
+    if (sfd < 0) return 0;
+    a = malloc(2 * storeBufSize);
+    if (!a) goto closeReturn;
+    b = a + storeBufSize;
+    for (off = 0; ; off += n) {
+        n = pread(fd, a, storeBufSize, off);
+        m = pread(sfd, b, storeBufSize, off);
+        if (n < 0 || n != m || memcmp(a, b, n)) break;
+        if (n == 0) {
+            rv = 1;
+            break;
+        }
+    }
+    free(a);
+
+closeReturn:
+    close(sfd);
+    return rv;
+}
+
+
+/* Create the store directory and its subdirectories.
+   Return 1 if success, 0 otherwise.
+ */
+int
+storeOpen (bkupInfo* info)
+{
+    char* path;
+    int   i;
+
+
+    assert(info);
+    assert(info->store);
+
+    if (mkdir(info->store, S_IRWXU) && errno != EEXIST) {
+        errSysRet(("mkdir(%s)", info->store));
+        return 0;
+    }
+    for (i = 0; i < 256; ++i) {
+        path = storePath((uint64_t)i << 56, 0, info);
+        if (!path) return 0;
+        *rindex(path, '/') = '\0';
+        if (mkdir(path, S_IRWXU) && errno != EEXIST) {
+            errSysRet(("mkdir(%s)", path));
+            free(path);
+            return 0;
+        }
+        free(path);
+    }
+    return 1;
+}
+
+
+/* If a store file has the same attributes `st' and bytes as
+   `path', hard link it to `dst', which must not exist.
+   Return 1 if linked, 0 otherwise. *key is set to the store key
+   of `path' for storeAdd() if 0 is returned.
+ */
+int
+storeLink (char* path, char* dst, struct stat* st, uint64_t* key,
+           bkupInfo* info)
+{
+    char* spath;
+    int   fd;
+    int   n;
+    int   rv = 0;
+
+
+    assert(path);
+    assert(dst);
+    assert(st);
+    assert(key);
+    assert(info->store);
+
+    *key = 0;
+    fd = open(path, O_RDONLY|O_NOFOLLOW);
+    if (fd < 0) return 0;
+    if (!storeKey(fd, st, key, path)) goto closeReturn;
+
+    for (n = 0; n < storeMaxSlot && !rv; ++n) {
+        spath = storePath(*key, n, info);
+        if (!spath) break;
+        if (access(spath, F_OK)) {
+            free(spath);        /* no more store files for *key */
+            break;
+        }
+        if (storeSame(fd, st, spath)) {
+            if (!link(spath, dst)) {
+                rv = 1;
+            } else if (errno != EMLINK) {
+                errSysRet(("link(%s, %s)", spath, dst));
+                free(spath);
+                break;
+            }
+        }
+        free(spath);
+    }
+
+closeReturn:
+    close(fd);
+    return rv;
+}
+
+
+/* Add `dst' with store key `key' to the store
+ */
+void
+storeAdd (char* dst, uint64_t key, bkupInfo* info)
+{
+    char* spath;
+    int   n;
+
+
+    assert(dst);
+    assert(info->store);
+
+    for (n = 0; n < storeMaxSlot; ++n) {
+        spath = storePath(key, n, info);
+        if (!spath) return;
+        if (!link(dst, spath)) {
+            free(spath);
+            return;
+        }
+        free(spath);
+        if (errno != EEXIST) {
+            errSysRet(("link(%s, store)", dst));
+            return;
+        }
+    }
+}
+
+
+/* Replace the files in `dir' only in this backup (link count 1)
+   with the store files of the same contents, or add them to the
+   store.
+ */
+static void
+storeDir (char* dir, bkupInfo* info)
+{
+    struct dirent* pEnt;
+    struct stat    stbuf;
+    DIR*           pDir;
+    uint64_t       key;
+    char*          path;
+    char*          tmp;
+    int            len;
+    int            fd;
+
+
+    pDir = opendir(dir);
+    if (!pDir) {
+        errSysRet(("opendir(%s)", dir));
+        return;
+    }
+    /* Backups of several hosts may use the store at the same time:
+       take a name no other process has with mkstemp(), and free it
+       for storeLink(), whose link() fails if the name is taken.
+       It is in the store so that rename() works.
+     */
+    tmp = storePath(0, 0, info);
+    if (!tmp) goto closeReturn;
+    strcpy(rindex(tmp, '/') + 1, "tmp.XXXXXX");
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        errSysRet(("mkstemp(%s)", tmp));
+        free(tmp);
+        goto closeReturn;
+    }
+    close(fd);
+    if (unlink(tmp)) {
+        errSysRet(("unlink(%s)", tmp));
+        free(tmp);
+        goto closeReturn;
+    }
+    for (pEnt = readdir(pDir); pEnt; pEnt = readdir(pDir)) {
+        if (!strcmp(".", pEnt->d_name)) continue;
+        if (!strcmp("..", pEnt->d_name)) continue;
+        len = strlen(dir) + strlen(pEnt->d_name) + 2;
+        path = malloc(len);
+        if (!path) {
+            errSysRet(("malloc(%s/%s)", dir, pEnt->d_name));
+            break;
+        }
+        snprintf(path, len, "%s/%s", dir, pEnt->d_name);
+        if (lstat(path, &stbuf)) {
+            errSysRet(("lstat(%s)", path));
+        } else if (S_ISDIR(stbuf.st_mode)) {
+            storeDir(path, info);
+        } else if (S_ISREG(stbuf.st_mode) && stbuf.st_nlink == 1 &&
+                   stbuf.st_size > 0) {
+            if (!storeLink(path, tmp, &stbuf, &key, info)) {
+                if (key) storeAdd(path, key, info);
+            } else if (rename(tmp, path)) {
+                errSysRet(("rename(%s, %s)", tmp, path));
+                unlink(tmp);
+            }
+        }
+        free(path);
+    }
+    free(tmp);
+
+closeReturn:
+    closedir(pDir);
+}
+
+
+/* Deduplicate the files received from remote host into info->bdir
+ */
+void
+storeTree (bkupInfo* info)
+{
+    char* path;
+    int   len;
+
+
+    assert(info);
+    assert(info->store);
+
+    len = info->blen + strlen(info->src) + 1;
+    path = malloc(len);
+    if (!path) {
+        errSysRet(("malloc(%s%s)", info->bdir, info->src));
+        return;
+    }
+    snprintf(path, len, "%s%s", info->bdir, info->src);
+    storeDir(path, info);
+    free(path);
+}
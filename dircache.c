@@ -0,0 +1,368 @@
+/* $Id$
+
+   dircache.c: hard links relative to cached directory descriptors
+
+
+   Copyright (c) 2026, Yoichi Hariguchi
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+       o Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+       o Redistributions in binary form must reproduce the above
+         copyright notice, this list of conditions and the following
+         disclaimer in the documentation and/or other materials provided
+         with the distribution.
+       o Neither the name of the Yoichi Hariguchi nor the names of its
+         contributors may be used to endorse or promote products derived
+         from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "backupfs.h"
+#include "error.h"
+
+#ifndef O_PATH
+#define O_PATH O_RDONLY
+#endif
+
+enum {
+    linkArena = 1 << 18,        /* path names of links in the ring */
+};
+
+
+/* Backups link millions of files from a few directories at a
+   time: the last backup and the new backup of the directory
+   being walked. link() resolves every component of both full
+   path names. Keep those directories open and call linkat()
+   with the base names instead.
+ */
+typedef struct {
+    char*         path;         /* directory path name */
+    size_t        len;          /* strlen(path) */
+    size_t        mlen;         /* malloc'ed length of path */
+    int           fd;           /* -1: not open */
+    unsigned long used;         /* for LRU */
+} dirEnt;
+
+/* A link queued in the ring: offsets of the path names in
+   dirCache.arena
+ */
+typedef struct {
+    size_t        src;
+    size_t        dest;
+} linkReq;
+
+struct _dirCache {
+    dirEnt*       ent;
+    int           nent;
+    int           last;         /* last hit */
+    unsigned long clock;
+    uring*        ring;         /* NULL: link() one by one */
+    linkReq*      req;          /* links in the ring */
+    unsigned      nreq;
+    unsigned      depth;        /* max # of req */
+    char*         arena;
+    size_t        used;         /* bytes used in arena */
+    linkFailed    failed;       /* called for each link failed in ring */
+    void*         arg;
+    dirOpener     open;         /* NULL: open() */
+    void*         openArg;
+};
+
+
+dirCache*
+dirCacheNew (int nent)
+{
+    dirCache* dc;
+    int       i;
+
+
+    assert(nent > 0);
+
+    dc = calloc(1, sizeof(*dc));
+    if (!dc) {
+        errSysRet(("calloc(dirCache)"));
+        return NULL;
+    }
+    dc->ent = calloc(nent, sizeof(*dc->ent));
+    if (!dc->ent) {
+        errSysRet(("calloc(%d dirEnt)", nent));
+        free(dc);
+        return NULL;
+    }
+    for (i = 0; i < nent; ++i) dc->ent[i].fd = -1;
+    dc->nent = nent;
+    return dc;
+}
+
+
+void
+dirCacheFree (dirCache* dc)
+{
+    int i;
+
+
+    if (!dc) return;
+    dirCacheFlush(dc);
+    uringClose(dc->ring);
+    free(dc->req);
+    free(dc->arena);
+    for (i = 0; i < dc->nent; ++i) {
+        if (dc->ent[i].fd >= 0) close(dc->ent[i].fd);
+        free(dc->ent[i].path);
+    }
+    free(dc->ent);
+    free(dc);
+}
+
+
+/* Return the descriptor of the directory `path' of length `len'
+   (not '\0' terminated), opening it in place of the least
+   recently used one if it is not cached. Return -1 on error.
+ */
+static int
+dirCacheFd (dirCache* dc, char* path, size_t len)
+{
+    dirEnt* e;
+    dirEnt* lru;
+    char*   p;
+    int     i;
+
+
+    e = dc->ent + dc->last;
+    if (e->fd >= 0 && e->len == len && !memcmp(e->path, path, len)) {
+        e->used = ++dc->clock;
+        return e->fd;
+    }
+    lru = dc->ent;
+    for (i = 0; i < dc->nent; ++i) {
+        e = dc->ent + i;
+        if (e->fd >= 0 && e->len == len && !memcmp(e->path, path, len)) {
+            dc->last = i;
+            e->used = ++dc->clock;
+            return e->fd;
+        }
+        if (e->used < lru->used) lru = e;
+    }
+
+    if (lru->fd >= 0) {
+        dirCacheFlush(dc);      /* the ring may refer to it */
+        close(lru->fd);
+        lru->fd = -1;
+    }
+    if (lru->mlen < len + 1) {
+        p = realloc(lru->path, len + 1);
+        if (!p) return -1;
+        lru->path = p;
+        lru->mlen = len + 1;
+    }
+    memcpy(lru->path, path, len);
+    lru->path[len] = '\0';
+    lru->len = len;
+    if (dc->open) {
+        lru->fd = (*dc->open)(lru->path, dc->openArg);
+    } else {
+        lru->fd = open(lru->path, O_PATH|O_DIRECTORY|O_CLOEXEC);
+    }
+    if (lru->fd < 0) return -1;
+    dc->last = lru - dc->ent;
+    lru->used = ++dc->clock;
+    return lru->fd;
+}
+
+
+/* Queue linkat(sfd, sf, dfd, df) in the ring. `sf' and `df'
+   are the base names in `src' and `dest'.
+ */
+static int
+queueLink (dirCache* dc, char* src, char* sf, int sfd,
+           char* dest, char* df, int dfd)
+{
+    size_t   slen = strlen(src) + 1;
+    size_t   dlen = strlen(dest) + 1;
+    linkReq* q;
+
+
+    if (dc->nreq == dc->depth || !uringSpace(dc->ring) ||
+        dc->used + slen + dlen > linkArena) {
+        dirCacheFlush(dc);
+        if (slen + dlen > linkArena) return !linkat(sfd, sf, dfd, df, 0);
+    }
+    q = dc->req + dc->nreq;
+    q->src  = dc->used;
+    q->dest = dc->used + slen;
+    memcpy(dc->arena + q->src, src, slen);
+    memcpy(dc->arena + q->dest, dest, dlen);
+    dc->used += slen + dlen;
+    uringLinkat(dc->ring, sfd, dc->arena + q->src + (sf - src),
+                dfd, dc->arena + q->dest + (df - dest), dc->nreq);
+    ++dc->nreq;
+    return 1;
+}
+
+
+/* Make dirCacheLink() queue links in io_uring. `func' is
+   called with `arg' for each of them which failed.
+   Return 0 if io_uring can't be used; links are made one by
+   one then.
+ */
+int
+dirCacheRing (dirCache* dc, linkFailed func, void* arg)
+{
+    assert(dc);
+
+    dc->ring = uringOpen(linkBatch);
+    if (!dc->ring) return 0;
+    dc->depth = uringSpace(dc->ring);
+    dc->req   = malloc(dc->depth * sizeof(*dc->req));
+    dc->arena = malloc(linkArena);
+    if (!dc->req || !dc->arena) {
+        errSysRet(("malloc(%d links)", dc->depth));
+        uringClose(dc->ring);
+        free(dc->req);
+        free(dc->arena);
+        dc->ring  = NULL;
+        dc->req   = NULL;
+        dc->arena = NULL;
+        return 0;
+    }
+    dc->failed = func;
+    dc->arg    = arg;
+    return 1;
+}
+
+
+/* Open the directories with `func' instead of open(). It is
+   called with the path name and `arg', and returns an O_PATH
+   descriptor or -1. Path names are then never resolved by
+   link(), so the fall backs of dirCacheLink() fail instead.
+ */
+void
+dirCacheOpener (dirCache* dc, dirOpener func, void* arg)
+{
+    assert(dc);
+
+    dc->open    = func;
+    dc->openArg = arg;
+}
+
+
+/* Return the cached descriptor of the directory of `path', and
+   set *base to the base name of `path'. Return -1 on error.
+   The descriptor is valid until the next call for `dc'.
+ */
+int
+dirCacheDir (dirCache* dc, char* path, char** base)
+{
+    char* f;
+
+
+    assert(dc);
+    assert(path);
+    assert(base);
+
+    f = strrchr(path, '/');
+    if (!f) {
+        errno = EINVAL;
+        return -1;
+    }
+    *base = f + 1;
+    return dirCacheFd(dc, path, (f == path) ? 1 : (size_t)(f - path));
+}
+
+
+/* Wait until all the links in the ring are made
+ */
+void
+dirCacheFlush (dirCache* dc)
+{
+    linkReq* q;
+    uint64_t data;
+    unsigned n;
+    int      res;
+
+
+    if (!dc || !dc->nreq) return;
+    n = dc->nreq;
+    if (!uringSubmit(dc->ring, n)) {
+        errSysExit(("io_uring_enter(linkat)"));
+    }
+    while (n > 0) {
+        if (!uringReap(dc->ring, &data, &res)) {
+            if (!uringSubmit(dc->ring, 1)) {
+                errSysExit(("io_uring_enter(linkat)"));
+            }
+            continue;
+        }
+        --n;
+        if (res < 0 && dc->failed) {
+            q = dc->req + data;
+            (*dc->failed)(dc->arena + q->src, dc->arena + q->dest,
+                          -res, dc->arg);
+        }
+    }
+    dc->nreq = 0;
+    dc->used = 0;
+}
+
+
+/* link(src, dest) relative to the cached directories of `src'
+   and `dest'. Fall back to link() if a directory can't be
+   opened. If the links are queued in io_uring, return 1 and
+   report failures later to the function given to dirCacheRing().
+   Return 1 on success, 0 on failure with errno set.
+ */
+int
+dirCacheLink (char* src, char* dest, dirCache* dc)
+{
+    char* sf;                   /* base name of src */
+    char* df;                   /* base name of dest */
+    int   sfd, dfd;
+
+
+    assert(src);
+    assert(dest);
+
+    sf = strrchr(src, '/');
+    df = strrchr(dest, '/');
+    if (!dc) return !link(src, dest);
+    if (!sf || !df) return dc->open ? 0 : !link(src, dest);
+
+    /* "/file" is in "/" */
+    sfd = dirCacheFd(dc, src, (sf == src) ? 1 : (size_t)(sf - src));
+    if (sfd < 0) return dc->open ? 0 : !link(src, dest);
+    dfd = dirCacheFd(dc, dest, (df == dest) ? 1 : (size_t)(df - dest));
+    if (dfd < 0) return dc->open ? 0 : !link(src, dest);
+    if (dc->ring) return queueLink(dc, src, sf + 1, sfd, dest, df + 1, dfd);
+    return !linkat(sfd, sf + 1, dfd, df + 1, 0);
+}
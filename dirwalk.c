@@ -34,112 +34,969 @@
 
  */
 
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/vfs.h>
 #include <dirent.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <linux/magic.h>
+#endif
 
+#include "string-rbt.h"
 #include "backupfs.h"
 #include "error.h"
 
 
-/* This is a recursive function.
+/* A directory to be walked.
+   `dp' stays open as long as any of its subdirectories is
+   waiting in a queue so that they can be opened by openat()
+   relative to it instead of resolving the full path again.
+ */
+typedef struct _walkDir {
+    struct _walkDir* parent;    /* NULL for the top directory */
+    DIR*             dp;        /* NULL until opened */
+    int              ref;       /* 1 (self) + # of unopened subdirs */
+    char*            bkupdir;   /* backup directory (malloc'ed) */
+    char*            path;      /* source directory */
+    char*            name;      /* last component of `path' */
+    dev_t            dev;       /* file system of the directory */
+    int              netfs;     /* network file system (-1: unknown) */
+} walkDir;
+
+
+/* Per-worker double-ended queue.
+   The owner pushes and pops at the tail (depth first),
+   other workers steal from the head.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    walkDir**       dir;
+    size_t          head;
+    size_t          tail;
+    size_t          size;
+} walkQueue;
+
+/* Directory entries stat'ed together in io_uring (-u)
+ */
+typedef struct {
+    uring*      ring;
+    char        name[statBatch][NAME_MAX + 1];
+    char*       p[statBatch];   /* p[i] == name[i] */
+    struct stat st[statBatch];
+    int         ok[statBatch];  /* 1 if st[i] is valid */
+} walkBatch;
+
+typedef struct _walkPool walkPool;
+
+typedef struct {
+    walkPool*  pool;
+    walkQueue  q;
+    bkupInfo   info;            /* per-thread copy given to info->func */
+    walkBatch* batch;           /* NULL: stat entries one by one */
+    pthread_t  tid;
+    int        id;
+} walkWorker;
+
+struct _walkPool {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    walkWorker*     worker;
+    int             nworkers;
+    int             idle;       /* # of sleeping workers */
+    long            pending;    /* # of queued or running directories */
+    unsigned long   seq;        /* incremented on every push */
+};
+
+
+/* Return the number of walker threads to use.
+   Also used for loading text journals.
  */
 int
-dirwalk (char* dir, bkupInfo* info)
+walkThreads (bkupInfo* info)
 {
-    DIR*           pDir;
-    struct dirent* pEnt;
-    struct stat    stbuf;
-    char*          newdir;      /* new (next) source directory */
-    char*          bkupdir;     /* backup directory */
+    long n;
 
 
-    assert(dir);
-    assert(info);
-    assert(info->bdir);
-    assert(info->func);
+    if (info->nthreads > 0) return info->nthreads;
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) return 1;
+    if (n > maxWalkThreads) return maxWalkThreads;
+    return n;
+}
 
-    pDir = opendir(dir);
-    if (!pDir) {
-        errSysRet(("opendir(%s)", dir));
+
+/* Each worker keeps up to (depth of tree) directories open.
+   Make sure deep trees walked by many threads don't hit EMFILE.
+ */
+static void
+raiseFileLimit (void)
+{
+    struct rlimit rl;
+
+
+    if (getrlimit(RLIMIT_NOFILE, &rl)) {
+        errSysRet(("getrlimit(RLIMIT_NOFILE)"));
+        return;
+    }
+    if (rl.rlim_cur == rl.rlim_max) return;
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl)) {
+        errSysRet(("setrlimit(RLIMIT_NOFILE, %ld)", (long)rl.rlim_max));
+    }
+}
+
+
+static int
+queuePush (walkQueue* q, walkDir* d)
+{
+    walkDir** p;
+    size_t    n;
+
+
+    pthread_mutex_lock(&q->lock);
+    if (q->tail == q->size) {
+        n = q->tail - q->head;
+        if (q->head) {
+            memmove(q->dir, q->dir + q->head, n * sizeof(*q->dir));
+            q->head = 0;
+            q->tail = n;
+        }
+        if (n == q->size) {
+            n = q->size ? 2 * q->size : MAXCHARS;
+            p = realloc(q->dir, n * sizeof(*q->dir));
+            if (!p) {
+                pthread_mutex_unlock(&q->lock);
+                errSysRet(("realloc(%d)", n * sizeof(*q->dir)));
+                return 0;
+            }
+            q->dir  = p;
+            q->size = n;
+        }
+    }
+    q->dir[q->tail++] = d;
+    pthread_mutex_unlock(&q->lock);
+    return 1;
+}
+
+
+/* Owner side: last in, first out
+ */
+static walkDir*
+queuePop (walkQueue* q)
+{
+    walkDir* d = NULL;
+
+
+    pthread_mutex_lock(&q->lock);
+    if (q->tail > q->head) {
+        d = q->dir[--q->tail];
+    }
+    if (q->tail == q->head) {
+        q->head = q->tail = 0;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return d;
+}
+
+
+/* Thief side: first in, first out. Shallow directories
+   tend to have bigger subtrees, so steal from the head.
+ */
+static walkDir*
+queueSteal (walkQueue* q)
+{
+    walkDir* d = NULL;
+
+
+    pthread_mutex_lock(&q->lock);
+    if (q->tail > q->head) {
+        d = q->dir[q->head++];
+    }
+    pthread_mutex_unlock(&q->lock);
+    return d;
+}
+
+
+static walkDir*
+stealDir (walkWorker* w)
+{
+    walkPool* pool = w->pool;
+    walkDir*  d;
+    int       i;
+
+
+    for (i = 1; i < pool->nworkers; ++i) {
+        d = queueSteal(&pool->worker[(w->id + i) % pool->nworkers].q);
+        if (d) return d;
+    }
+    return NULL;
+}
+
+
+static void
+releaseDir (walkDir* d)
+{
+    if (__atomic_sub_fetch(&d->ref, 1, __ATOMIC_ACQ_REL) > 0) return;
+    if (d->dp && closedir(d->dp)) {
+        errSysRet(("closedir(%s)", d->path));
+    }
+    free(d->bkupdir);
+    free(d);
+}
+
+
+/* Allocate a subdirectory `name' of `parent' and set up
+   both its backup and source path names.
+ */
+static walkDir*
+newWalkDir (walkDir* parent, char* name, bkupInfo* info)
+{
+    walkDir* d;
+    int      len;
+
+
+    d = calloc(1, sizeof(*d));
+    if (!d) {
+        errSysRet(("calloc(%s/%s)", parent->path, name));
+        return NULL;
+    }
+    len = info->blen + strlen(parent->path) + strlen(name) + 3;
+    d->bkupdir = malloc(len);
+    if (!d->bkupdir) {
+        errSysRet(("%s/%s/%s: can't alloc memory",
+                   info->bdir, parent->path, name));
+        free(d);
+        return NULL;
+    }
+    strcpy(d->bkupdir, info->bdir);
+    if (*parent->path != '/') {
+        strcat(d->bkupdir, "/");
+    }
+    strcat(d->bkupdir, parent->path);
+    strcat(d->bkupdir, "/");
+    d->name = d->bkupdir + strlen(d->bkupdir);
+    strcpy(d->name, name);
+    d->path   = d->bkupdir + info->blen;
+    d->parent = parent;
+    d->ref    = 1;
+    return d;
+}
+
+
+static void
+pushDir (walkWorker* w, walkDir* d)
+{
+    walkPool* pool = w->pool;
+
+
+    /* Count it before it becomes visible to thieves so that
+       `pending' never drops to zero while work is left.
+     */
+    pthread_mutex_lock(&pool->lock);
+    ++pool->pending;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!queuePush(&w->q, d)) {
+        errRet(("%s: not walked", d->path));
+        pthread_mutex_lock(&pool->lock);
+        --pool->pending;
+        pthread_mutex_unlock(&pool->lock);
+        releaseDir(d->parent);
+        releaseDir(d);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    ++pool->seq;
+    if (pool->idle) {
+        pthread_cond_signal(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/* Return 1 if directory `fd' is on a network file system,
+   where every stat which is not answered from the cached
+   attributes is a round trip to the server.
+ */
+static int
+isNetFs (int fd)
+{
+    struct statfs sf;
+
+
+    if (fstatfs(fd, &sf)) return 0;
+    switch (sf.f_type) {
+#ifdef __linux__
+    case NFS_SUPER_MAGIC:
+    case SMB_SUPER_MAGIC:
+    case CIFS_SUPER_MAGIC:
+    case SMB2_SUPER_MAGIC:
+    case CEPH_SUPER_MAGIC:
+    case AFS_SUPER_MAGIC:
+        return 1;
+#endif
+    default:
         return 0;
     }
-    if (chdir(dir)) {
-        errSysRet(("chdir(%s)", dir));
+}
+
+
+/* Open queued directory `d' relative to its parent.
+   Return 1 if success, 0 otherwise.
+ */
+static int
+openWalkDir (walkDir* d)
+{
+    int fd;
+
+
+    fd = openat(dirfd(d->parent->dp), d->name,
+                O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    if (fd < 0) {
+        errSysRet(("openat(%s)", d->path));
+    } else {
+        if (d->netfs < 0) d->netfs = isNetFs(fd);
+        if (!(d->dp = fdopendir(fd))) {
+            errSysRet(("fdopendir(%s)", d->path));
+            close(fd);
+        }
+    }
+    releaseDir(d->parent);      /* parent's fd no longer needed */
+    d->parent = NULL;
+    return d->dp ? 1 : 0;
+}
+
+
+/* Return 1 if `name' of type `mode' is not backed up.
+ */
+static int
+isIgnored (walkDir* d, char* name, mode_t mode)
+{
+    switch (mode & S_IFMT) {
+    case S_IFSOCK:
+        printf("%s/%s: socket ignored\n", d->path, name);
+        return 1;
+    case S_IFBLK:
+        printf("%s/%s: block device ignored\n", d->path, name);
+        return 1;
+    case S_IFCHR:
+        printf("%s/%s: character device ignored\n", d->path, name);
+        return 1;
+    case S_IFIFO:
+        printf("%s/%s: fifo ignored\n", d->path, name);
+        return 1;
+    default:
         return 0;
     }
-    for (pEnt = readdir(pDir); pEnt; pEnt = readdir(pDir)) {
-        if (lstat(pEnt->d_name, &stbuf)) {
-            errSysRet(("stat(%s)", pEnt->d_name));
-            continue;
+}
+
+
+static int
+isDotOrDotDot (char* name)
+{
+    return name[0] == '.' &&
+           (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+
+/* Return 1 if readdir() entry `pEnt' of `d' needs no stat:
+   `.', `..' and the file types which are not backed up.
+ */
+static int
+isSkipped (walkDir* d, struct dirent* pEnt)
+{
+    if (isDotOrDotDot(pEnt->d_name)) return 1;
+    return pEnt->d_type != DT_UNKNOWN &&
+           isIgnored(d, pEnt->d_name, DTTOIF(pEnt->d_type));
+}
+
+
+/* Stat `name' in directory `d' unless `pst' is already its
+   stat, and call info->func if it is a file. If it is a
+   directory, create it in the backup directory and return it
+   to be walked. Return NULL otherwise.
+ */
+static walkDir*
+walkEntry (walkDir* d, char* name, struct stat* pst, bkupInfo* info)
+{
+    struct stat stbuf;
+    walkDir*    sub;
+
+
+    if (!pst) {
+        if (statAt(dirfd(d->dp), name, &stbuf, d->netfs)) {
+            errSysRet(("stat(%s/%s)", d->path, name));
+            return NULL;
         }
-        switch (stbuf.st_mode & S_IFMT) {
-        case S_IFSOCK:
-            printf("%s/%s: socket ignored\n", dir, pEnt->d_name);
-            break;
-        case S_IFBLK:
-            printf("%s/%s: block device ignored\n", dir, pEnt->d_name);
-            break;
-        case S_IFCHR:
-            printf("%s/%s: character device ignored\n", dir, pEnt->d_name);
-            break;
-        case S_IFIFO:
-            printf("%s/%s: fifo ignored\n", dir, pEnt->d_name);
+        pst = &stbuf;
+    }
+    if (isIgnored(d, name, pst->st_mode)) return NULL;
+
+    switch (pst->st_mode & S_IFMT) {
+    case S_IFDIR:
+        sub = newWalkDir(d, name, info);
+        if (!sub) break;
+        sub->dev   = pst->st_dev;
+        sub->netfs = (pst->st_dev == d->dev) ? d->netfs : -1;
+        if (!newDirectory(sub->bkupdir, pst, info)) {
+            errRet(("newDirectory(%s, 0x%08x)", sub->bkupdir, pst->st_mode));
+            free(sub->bkupdir);
+            free(sub);
             break;
-        case S_IFDIR:
-            if (strcmp(".", pEnt->d_name) == 0) {
-                break;
-            }
-            if (strcmp("..", pEnt->d_name) == 0) {
-                break;
-            }
-            bkupdir = malloc(info->blen +
-                             strlen(dir) + strlen(pEnt->d_name) + 3);
-            if (!bkupdir) {
-                errSysRet(("%s/%s/%s: can't alloc memory",
-                           info->bdir, dir, pEnt->d_name));
-                continue;
-            }
-            strcpy(bkupdir, info->bdir);
-            if (*dir != '/') {
-                strcat(bkupdir, "/");
+        }
+        __atomic_add_fetch(&d->ref, 1, __ATOMIC_ACQ_REL);
+        return sub;
+    case S_IFLNK:
+    case S_IFREG:
+        info->ctime = pst->st_ctime;
+        info->mtime = pst->st_mtime;
+        info->stbuf = pst;
+        (*info->func)(d->path, name, info);
+        break;
+    default:
+        errRet(("%s/%s: unknown type (0x%x) ignored\n",
+              d->path, name, pst->st_mode & S_IFMT));
+        break;
+    }
+    return NULL;
+}
+
+
+static walkBatch*
+newBatch (void)
+{
+    walkBatch* b;
+    int        i;
+
+
+    b = malloc(sizeof(*b));
+    if (!b) return NULL;
+    b->ring = uringOpen(statBatch);
+    if (!b->ring) {
+        free(b);
+        return NULL;
+    }
+    for (i = 0; i < statBatch; ++i) b->p[i] = b->name[i];
+    return b;
+}
+
+
+static void
+freeBatch (walkBatch* b)
+{
+    if (!b) return;
+    uringClose(b->ring);
+    free(b);
+}
+
+
+/* walkOne() stat'ing statBatch entries at a time in io_uring
+ */
+static void
+walkBatched (walkWorker* w, walkDir* d)
+{
+    walkBatch*     b = w->batch;
+    struct dirent* pEnt;
+    walkDir*       sub;
+    int            i, n;
+
+
+    do {
+        for (n = 0; n < statBatch && (pEnt = readdir(d->dp)); ) {
+            if (isSkipped(d, pEnt)) continue;
+            strcpy(b->name[n++], pEnt->d_name);
+        }
+        uringStat(b->ring, dirfd(d->dp), b->p, n, b->st, b->ok, d->netfs);
+        for (i = 0; i < n; ++i) {
+            sub = walkEntry(d, b->p[i], b->ok[i] ? b->st + i : NULL, &w->info);
+            if (sub) pushDir(w, sub);
+        }
+    } while (n == statBatch);
+}
+
+
+/* An entry of a directory read by readEntries()
+ */
+typedef struct {
+    char*        name;
+    ino_t        ino;           /* d_ino */
+    struct stat* st;            /* NULL: not stat'ed yet */
+} walkEnt;
+
+
+static void
+freeEntries (walkEnt* ent, size_t n)
+{
+    while (n > 0) free(ent[--n].name);
+    free(ent);
+}
+
+
+/* Read all the entries of `d' but the ones isSkipped() into
+   `*ent'. Return # of the entries, or -1 on failure.
+ */
+static long
+readEntries (walkDir* d, walkEnt** ent)
+{
+    struct dirent* pEnt;
+    walkEnt*       e = NULL;
+    walkEnt*       p;
+    size_t         n, size;
+
+
+    n = size = 0;
+    for (pEnt = readdir(d->dp); pEnt; pEnt = readdir(d->dp)) {
+        if (isSkipped(d, pEnt)) continue;
+        if (n == size) {
+            size = size ? 2 * size : MAXARGS;
+            p = realloc(e, size * sizeof(*e));
+            if (!p) {
+                errSysRet(("realloc(%s: %d)", d->path, size));
+                goto errorReturn;
             }
-            strcat(bkupdir, dir);
-            strcat(bkupdir, "/");
-            strcat(bkupdir, pEnt->d_name);
-            newdir = bkupdir + info->blen;
-            if (!newDirectory(bkupdir, &stbuf, info)) {
-                errRet(("newDirectory(%s, 0x%08x)", bkupdir, stbuf.st_mode));
-                continue;
+            e = p;
+        }
+        e[n].name = strdup(pEnt->d_name);
+        if (!e[n].name) {
+            errSysRet(("strdup(%s/%s)", d->path, pEnt->d_name));
+            goto errorReturn;
+        }
+        e[n].ino = pEnt->d_ino;
+        e[n].st  = NULL;
+        ++n;
+    }
+    *ent = e;
+    return n;
+
+errorReturn:
+    freeEntries(e, n);
+    return -1;
+}
+
+
+/* Stat the `n' entries in the order they are in `ent' into
+   `st', statBatch at a time in io_uring if `b' is not NULL.
+   ent[i].st stays NULL if it can't be stat'ed here.
+ */
+static void
+statEntries (walkDir* d, walkEnt* ent, size_t n, struct stat* st,
+             walkBatch* b)
+{
+    char*  name[statBatch];
+    size_t i, k, m;
+
+
+    if (!b) {
+        for (i = 0; i < n; ++i) {
+            if (!statAt(dirfd(d->dp), ent[i].name, st + i, d->netfs)) {
+                ent[i].st = st + i;
             }
-            dirwalk(newdir, info); /* recursion */
-            free(bkupdir);
-            if (chdir(dir)) {
-                errSysRet(("chdir(%s)", dir));
-                return 0;
+        }
+        return;
+    }
+    for (i = 0; i < n; i += m) {
+        m = (n - i < statBatch) ? n - i : statBatch;
+        for (k = 0; k < m; ++k) name[k] = ent[i + k].name;
+        uringStat(b->ring, dirfd(d->dp), name, m, st + i, b->ok, d->netfs);
+        for (k = 0; k < m; ++k) {
+            if (b->ok[k]) ent[i + k].st = st + i + k;
+        }
+    }
+}
+
+
+static int
+nameCmp (const void* a, const void* b)
+{
+    return strcmp(((walkEnt*)a)->name, ((walkEnt*)b)->name);
+}
+
+
+static int
+inoCmp (const void* a, const void* b)
+{
+    ino_t ia = ((walkEnt*)a)->ino;
+    ino_t ib = ((walkEnt*)b)->ino;
+
+
+    return (ia > ib) - (ia < ib);
+}
+
+
+/* walkOne() for rotational disks (-H): read all the entries
+   of `d' and visit them in inode order, which is usually the
+   order of the inode table on the disk.
+ */
+static void
+walkInodeOrder (walkWorker* w, walkDir* d)
+{
+    walkEnt*     ent;
+    struct stat* st;
+    walkDir*     sub;
+    long         n, i;
+
+
+    n = readEntries(d, &ent);
+    if (n < 0) return;
+    qsort(ent, n, sizeof(*ent), inoCmp);
+    st = n ? malloc(n * sizeof(*st)) : NULL;
+    if (st) statEntries(d, ent, n, st, w->batch);
+    for (i = 0; i < n; ++i) {
+        sub = walkEntry(d, ent[i].name, ent[i].st, &w->info);
+        if (sub) pushDir(w, sub);
+    }
+    freeEntries(ent, n);
+    free(st);
+}
+
+
+/* Read directory `d' and call info->func for each file.
+   Subdirectories are created in the backup directory, then
+   queued to be walked by any worker.
+ */
+static void
+walkOne (walkWorker* w, walkDir* d)
+{
+    struct dirent* pEnt;
+    walkDir*       sub;
+
+
+    if (!d->dp && !openWalkDir(d)) goto release;
+
+    if (w->info.hdd) {
+        walkInodeOrder(w, d);
+        goto release;
+    }
+    if (w->batch) {
+        walkBatched(w, d);
+        goto release;
+    }
+    for (pEnt = readdir(d->dp); pEnt; pEnt = readdir(d->dp)) {
+        if (isSkipped(d, pEnt)) continue;
+        sub = walkEntry(d, pEnt->d_name, NULL, &w->info);
+        if (sub) pushDir(w, sub);
+    }
+
+release:
+    releaseDir(d);
+}
+
+
+/* Walk `d' in one thread, visiting entries in name order and
+   descending into each subdirectory as soon as it is met.
+   info->func is then called in pathCmp() order of the paths.
+   With `b' or -H, the entries are stat'ed first, in inode
+   order with -H.
+   This is a recursive function.
+ */
+static void
+walkSorted (walkDir* d, bkupInfo* info, walkBatch* b)
+{
+    walkEnt*     ent;
+    struct stat* st = NULL;
+    walkDir*     sub;
+    long         n, i;
+
+
+    if (!d->dp && !openWalkDir(d)) goto release;
+
+    n = readEntries(d, &ent);
+    if (n < 0) goto release;
+    if ((b || info->hdd) && n > 0) {
+        st = malloc(n * sizeof(*st));
+        if (st) {
+            if (info->hdd) qsort(ent, n, sizeof(*ent), inoCmp);
+            statEntries(d, ent, n, st, b);
+        }
+    }
+    qsort(ent, n, sizeof(*ent), nameCmp);
+
+    for (i = 0; i < n; ++i) {
+        sub = walkEntry(d, ent[i].name, ent[i].st, info);
+        if (sub) walkSorted(sub, info, b); /* recursion */
+    }
+    freeEntries(ent, n);
+    free(st);
+release:
+    releaseDir(d);
+}
+
+
+static void*
+walkWorkerMain (void* arg)
+{
+    walkWorker*   w    = arg;
+    walkPool*     pool = w->pool;
+    walkDir*      d;
+    unsigned long seq;
+    int           done;
+
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        seq = pool->seq;
+        pthread_mutex_unlock(&pool->lock);
+
+        d = queuePop(&w->q);
+        if (!d) d = stealDir(w);
+        if (d) {
+            walkOne(w, d);
+            pthread_mutex_lock(&pool->lock);
+            if (--pool->pending == 0) {
+                pthread_cond_broadcast(&pool->cond);
             }
-            break;
-        case S_IFLNK:
-        case S_IFREG:
-            info->ctime = stbuf.st_ctime;
-            info->mtime = stbuf.st_mtime;
-            info->stbuf = &stbuf;
-            (*info->func)(dir, pEnt->d_name, info);
-            break;
-        default:
-            errRet(("%s/%s: unknown type (0x%x) ignored\n",
-                  dir, pEnt->d_name, stbuf.st_mode & S_IFMT));
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+
+        /* Nothing to do. Sleep unless somebody pushed a
+           directory after `seq' was read.
+         */
+        pthread_mutex_lock(&pool->lock);
+        while (pool->pending > 0 && pool->seq == seq) {
+            ++pool->idle;
+            pthread_cond_wait(&pool->cond, &pool->lock);
+            --pool->idle;
+        }
+        done = (pool->pending == 0);
+        pthread_mutex_unlock(&pool->lock);
+        if (done) break;
+    }
+    return NULL;
+}
+
+
+/* A source file with more than one link in info->hardLinks
+ */
+typedef struct {
+    int   state;                /* linkFirst (pending), linkCopied, linkLinked */
+    char* lspath;               /* link src path if linkLinked */
+} linkEnt;
+
+
+static void
+linkKey (char* key, size_t len, struct stat* st)
+{
+    snprintf(key, len, "%llx:%llx",
+             (unsigned long long)st->st_dev, (unsigned long long)st->st_ino);
+}
+
+
+/* Look up the inode of info->stbuf, which has more than one link.
+   Return linkFirst if it is the first name of the inode; the
+   caller must then call setFirstLink() after backing it up.
+   Otherwise wait until the first name is backed up and return
+   linkCopied, or set *lspath to the link src path of the first
+   name and return linkLinked. Return linkNone if inodes are not
+   tracked.
+ */
+int
+firstLink (char** lspath, bkupInfo* info)
+{
+    linkMap* lm = info->hardLinks;
+    linkEnt* ent;
+    char     key[40];
+
+
+    assert(lspath);
+    assert(info->stbuf);
+
+    if (!lm) return linkNone;
+    linkKey(key, sizeof(key), info->stbuf);
+    pthread_mutex_lock(&lm->lock);
+    ent = stringRBTfind(lm->map, key);
+    if (!ent) {
+        ent = calloc(1, sizeof(*ent));
+        if (!ent || stringRBTinsert(lm->map, key, ent)) {
+            pthread_mutex_unlock(&lm->lock);
+            errRet(("can't remember %s", key));
+            free(ent);
+            return linkNone;
+        }
+        ent->state = linkFirst;
+        pthread_mutex_unlock(&lm->lock);
+        return linkFirst;
+    }
+    while (ent->state == linkFirst) {
+        pthread_cond_wait(&lm->decided, &lm->lock);
+    }
+    pthread_mutex_unlock(&lm->lock);
+    *lspath = ent->lspath;
+    return ent->state;
+}
+
+
+/* The first name of the inode of info->stbuf was linked from
+   `lspath', or copied if `lspath' is NULL.
+ */
+void
+setFirstLink (char* lspath, bkupInfo* info)
+{
+    linkMap* lm = info->hardLinks;
+    linkEnt* ent;
+    char     key[40];
+
+
+    assert(lm);
+
+    linkKey(key, sizeof(key), info->stbuf);
+    pthread_mutex_lock(&lm->lock);
+    ent = stringRBTfind(lm->map, key);
+    if (ent) {
+        ent->lspath = lspath ? strdup(lspath) : NULL;
+        ent->state  = ent->lspath ? linkLinked : linkCopied;
+        pthread_cond_broadcast(&lm->decided);
+    }
+    pthread_mutex_unlock(&lm->lock);
+}
+
+
+static void
+freeLinkEnt (const char* key, void* val, void* arg)
+{
+    linkEnt* ent = val;
+
+
+    free(ent->lspath);
+    free(ent);
+}
+
+
+/* Walk through the tree under `dir' with a pool of threads
+   and call info->func for each regular file and symbolic link.
+   info->func and newDirectory() may be called concurrently;
+   they must serialize their output with lockOutput().
+   If info->sorted is set, walk in one thread in path order.
+   Return 1 if `dir' was walked, 0 otherwise.
+ */
+int
+dirwalk (char* dir, bkupInfo* info)
+{
+    pthread_mutex_t outLock = PTHREAD_MUTEX_INITIALIZER;
+    linkMap         links;
+    walkBatch*      batch;
+    struct stat     stbuf;
+    walkPool        pool;
+    walkDir*        top;
+    int             fd;
+    int             i;
+    int             started;    /* # of running workers */
+    int             rv = 1;
+
+
+    assert(dir);
+    assert(info);
+    assert(info->bdir);
+    assert(info->func);
+
+    top = calloc(1, sizeof(*top));
+    if (!top) {
+        errSysRet(("calloc(%s)", dir));
+        return 0;
+    }
+    fd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (fd < 0 || !(top->dp = fdopendir(fd))) {
+        errSysRet(("opendir(%s)", dir));
+        if (fd >= 0) close(fd);
+        free(top);
+        return 0;
+    }
+    top->path  = dir;
+    top->name  = dir;
+    top->ref   = 1;
+    top->netfs = isNetFs(fd);
+    if (!fstat(fd, &stbuf)) top->dev = stbuf.st_dev;
+
+    links.map = stringRBTcreate();
+    if (links.map) {
+        pthread_mutex_init(&links.lock, NULL);
+        pthread_cond_init(&links.decided, NULL);
+        info->hardLinks = &links;
+    } else {
+        errRet(("stringRBTcreate() failed. Hard links not tracked"));
+    }
+
+    if (info->sorted) {
+        batch = info->uring ? newBatch() : NULL;
+        walkSorted(top, info, batch);
+        freeBatch(batch);
+        dirCacheFree(info->dirs);
+        info->dirs = NULL;
+        goto freeLinks;
+    }
+
+    memset(&pool, 0, sizeof(pool));
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    pool.nworkers = walkThreads(info);
+    pool.worker   = calloc(pool.nworkers, sizeof(*pool.worker));
+    if (!pool.worker) {
+        errSysRet(("calloc(%d workers)", pool.nworkers));
+        releaseDir(top);
+        rv = 0;
+        goto freeLinks;
+    }
+    raiseFileLimit();
+
+    info->lock = &outLock;
+    for (i = 0; i < pool.nworkers; ++i) {
+        pool.worker[i].pool = &pool;
+        pool.worker[i].id   = i;
+        pool.worker[i].info = *info;
+        pool.worker[i].info.dirs = NULL;
+        pool.worker[i].batch = info->uring ? newBatch() : NULL;
+        pthread_mutex_init(&pool.worker[i].q.lock, NULL);
+    }
+    pool.pending = 1;
+    queuePush(&pool.worker[0].q, top);
+
+    /* The calling thread is worker 0. The queues of workers
+       which failed to start simply stay empty.
+     */
+    for (started = 1; started < pool.nworkers; ++started) {
+        if (pthread_create(&pool.worker[started].tid, NULL,
+                           walkWorkerMain, &pool.worker[started])) {
+            errSysRet(("pthread_create(%d)", started));
             break;
         }
     }
-    if (closedir(pDir)) {
-        errSysRet(("closedir(%d)", dir));
+    walkWorkerMain(&pool.worker[0]);
+    for (i = 1; i < started; ++i) {
+        pthread_join(pool.worker[i].tid, NULL);
     }
-    return 1;
+    info->lock = NULL;
+
+    for (i = 0; i < pool.nworkers; ++i) {
+        free(pool.worker[i].q.dir);
+        dirCacheFree(pool.worker[i].info.dirs);
+        freeBatch(pool.worker[i].batch);
+        pthread_mutex_destroy(&pool.worker[i].q.lock);
+    }
+    free(pool.worker);
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.lock);
+
+freeLinks:
+    if (info->hardLinks) {
+        stringRBTwalk(links.map, freeLinkEnt, NULL);
+        stringRBTdestroy(links.map);
+        pthread_cond_destroy(&links.decided);
+        pthread_mutex_destroy(&links.lock);
+        info->hardLinks = NULL;
+    }
+    return rv;
 }
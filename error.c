@@ -50,7 +50,7 @@ errorDoit (int errnoflag, const char* fmt, va_list ap)
 {
     int errno_save;
     int len;
-    static char buf[MAXERRCHARS];
+    char buf[MAXERRCHARS];      /* dirwalk() threads may report at once */
 
 
     errno_save = errno;
@@ -38,6 +38,8 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -48,6 +50,11 @@
 #include <sys/wait.h>
 #include <dirent.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
 
 #include "string-rbt.h"
 #include "backupfs.h"
@@ -110,39 +117,7 @@ closeFiles (bkupInfo* info)
     assert(info);
 
     if (info->jnl) {
-        if (fclose(info->jnl)) errSysRet(("fclose(jnl)"));
-        info->jnl = NULL;
-    }
-    if (info->tar) {
-        if (fclose(info->tar)) errSysRet(("fclose(tar)"));
-        info->tar = NULL;
-    }
-    if (info->newdirs && fclose(info->newdirs)) {
-        errSysRet(("fclose(newdirs)"));
-    }
-    info->newdirs = NULL;
-    if (info->links && fclose(info->links)) {
-        errSysRet(("fclose(links)"));
-    }
-    info->links = NULL;
-}
-
-
-void
-removeFiles (bkupInfo* info)
-{
-    assert(info);
-
-    /* Hard link and tar files may not be created yet.
-     */
-    if (info->tpath && unlink(info->tpath)) {
-        errSysRet(("unlink(tpath:%s)", info->tpath));
-    }
-    if (info->ndpath && unlink(info->ndpath)) {
-        errSysRet(("unlink(ndpath:%s)", info->ndpath));
-    }
-    if (info->linkpath && unlink(info->linkpath)) {
-        errSysRet(("unlink(linkpath:%s)", info->linkpath));
+        closeJournal(info);
     }
 }
 
@@ -308,65 +283,6 @@ copyEntry (void* dest, const void* src)
 #endif/*0*/
 
 
-int
-makeJournalTree (bkupInfo* info)
-{
-    FILE* fp;                   /* journal file */
-    char* buf;
-    char* s;
-    journalEntry* ent;
-    size_t  len;
-    ssize_t rdlen;
-
-
-    assert(info);
-    assert(info->oldJpath);
-
-    buf = malloc(MAXCHARS);
-    if (!buf) {
-        errSysRet(("malloc(%d)", MAXCHARS));
-        return 0;
-    }
-    fp = fopen(info->oldJpath, "r");
-    if (!fp) {
-        errSysRet(("fopen(%s)", info->oldJpath));
-        return 0;
-    }
-    info->jt = stringRBTcreate();
-    if (!info->jt) {
-        errRet(("stringRBTcreate() failed"));
-        return 0;
-    }
-
-    while ((rdlen = getline(&buf, &len, fp)) > 0) {
-        buf[rdlen-1] = '\0';
-        ent = malloc(sizeof(*ent));
-        if (!ent) {
-            errSysRet(("malloc: %s", buf));
-        } else {
-            ent->ctime = strtol(buf, &s, 16);
-            ent->mtime = strtol(s, &s, 16);
-            ent->path = ++s;
-            if (stringRBTinsert(info->jt, ent->path, ent)) {
-                errRet(("stringRBTinsert(%s)", ent->path));
-                goto errReturn;
-            }
-        }
-    }
-    if (!feof(fp)) {
-        errSysRet(("getline"));
-        goto errReturn;
-    }
-
-    free(buf);
-    return 1;
-
-errReturn:
-    free(buf);
-    return 0;
-}
-
-
 int
 isDirEmpty (char* path)
 {
@@ -392,31 +308,42 @@ isDirEmpty (char* path)
 }
 
 
-int
-runCommands (bkupInfo* info)
+/* Return a key to read `path' in the order of the data on the
+   disk: the physical offset of its first extent. If the file
+   system can't tell (no FIEMAP), use the inode number, which
+   follows the allocation order on most file systems.
+   Return 0 if `path' can't be opened (symbolic links, ...).
+ */
+uint64_t
+diskOrder (char* path)
 {
-    char*      cmd;
-    int        len;
-    int        status;
-    pipeExitSt st;              /* return status in wait() format */
-
-
-    assert(info);
-    assert(info->tpath);
-    assert(info->bdir);
-
-    /* cd backup-directory for "tar xpf -"
-     */
-    if (chdir(info->bdir)) errSysExit(("chdir(%s)", info->bdir));
- 
-    len = strlen(TAR_SRC) + strlen(info->tpath) + 1;
-    cmd = malloc(len);
-    if (!cmd) errSysExit(("1: malloc(%d)", len));
-    snprintf(cmd, len, TAR_SRC, info->tpath);
-    st = execCommands(cmd, TAR_DST);
-    status = chkPipeExitSt(st, cmd, TAR_DST);
-    free(cmd);
-    return status;
+    struct stat stbuf;
+    uint64_t    key = 0;
+    int         fd;
+#ifdef FS_IOC_FIEMAP
+    struct {
+        struct fiemap        map;
+        struct fiemap_extent ext;
+    } fm;
+#endif
+
+
+    fd = open(path, O_RDONLY|O_NOATIME|O_NOFOLLOW|O_CLOEXEC);
+    if (fd < 0) return 0;
+    if (fstat(fd, &stbuf)) goto closeReturn;
+    key = stbuf.st_ino;
+#ifdef FS_IOC_FIEMAP
+    memset(&fm, 0, sizeof(fm));
+    fm.map.fm_length       = FIEMAP_MAX_OFFSET;
+    fm.map.fm_extent_count = 1;
+    if (!ioctl(fd, FS_IOC_FIEMAP, &fm.map) && fm.map.fm_mapped_extents) {
+        key = fm.ext.fe_physical;
+    }
+#endif
+
+closeReturn:
+    close(fd);
+    return key;
 }
 
 
@@ -734,6 +661,109 @@ restoreSigs:
 }
 
 
+/* Execute command string `cmd' and call `reader' with its stdout.
+   cmd's stdin is `in' unless it is negative.
+   *rv is set to the return value of `reader'.
+   Return value: cmd's exit status
+ */
+pipeExitSt
+execReader (char* cmd, pReader reader, int in, bkupInfo* info, int* rv)
+{
+    pid_t       pid;
+    int         fd[2];
+    int         status;
+    pipeExitSt  st;
+    sigset_t    chldMask, svMask;
+    char**      argv;
+    FILE*       fp;
+    intQuitSigs sigs;
+
+
+    assert(cmd);
+    assert(reader);
+    assert(rv);
+
+    *rv = 0;
+    memset(&st, 0, sizeof(st));
+    memset(&sigs, 0, sizeof(sigs));
+    if (!ignoreSigIntQuit(&sigs)) {
+        errRet(("sigIntQuitIgnore"));
+        return st;              /* isCmd1NormalExit(st) == 0 */
+    }
+    sigemptyset(&chldMask);
+    sigaddset(&chldMask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &chldMask, &svMask) < 0) {
+        errSysRet(("sigprocmask"));
+        goto restoreSigs;
+    }
+    if (pipe(fd) < 0) {
+        errSysExit(("pipe"));
+    }
+    fcntl(fd[0], F_SETPIPE_SZ, pipeSize); /* fewer wakeups; may fail */
+
+    pid = fork();
+    if (pid < 0) errSysExit(("fork: %s", cmd));
+    if (pid == 0) {  /* child */
+        waitGdb();
+        restoreSigIntQuit(&sigs);
+        sigprocmask(SIG_SETMASK, &svMask, NULL);
+        argv = mkArgs(cmd);
+        if (!argv) _exit(127);
+        close(fd[0]);           /* close read end */
+        if (fd[1] != 1) {
+            if (dup2(fd[1], 1) != 1) {
+                errSysRet(("dup2: stdout"));
+                _exit(127);
+            }
+            close(fd[1]);       /* fd[1] is duped to stdout */
+        }
+        if (in > 0) {           /* 0 is stdin already */
+            if (dup2(in, 0) != 0) {
+                errSysRet(("dup2: stdin"));
+                _exit(127);
+            }
+            close(in);
+        }
+        execvp(argv[0], argv);
+        free(argv[0]);          /* exec error */
+        free(argv);
+        _exit(127);
+    }
+
+    /* parent */
+    close(fd[1]);
+    fp = fdopen(fd[0], "r");
+    if (fp) {
+        *rv = reader(fp, info);
+        fclose(fp);             /* cmd gets SIGPIPE if it is not done */
+    } else {
+        errSysRet(("fdopen(%s)", cmd));
+        close(fd[0]);
+    }
+    while (waitpid(pid, &status, 0) < 0) {
+        errSysRet(("wait(%d)", status));
+        if (errno != EINTR) {
+            status = -1; /* error other than EINTR from waitpid() */
+            break;
+        }
+    }
+    cmd1Exited(&st);
+    setCmd1ExitType(&st, status);
+    if (isCmd1NormalExit(st)) st.status[0] = WEXITSTATUS(status);
+    if (isDebugOn()) {
+        dbgInfo(("%d/%d/%d", pid, isCmd1NormalExit(st), st.status[0]));
+    }
+    sigprocmask(SIG_SETMASK, &svMask, NULL);
+
+restoreSigs:
+    if (!restoreSigIntQuit(&sigs)) {
+        errRet(("restoreSigIntQuit()"));
+        st.status[0] = -1;
+    }
+    return st;
+}
+
+
 int
 chkCommandExitSt (int i, pipeExitSt st, char* cmd)
 {
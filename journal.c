@@ -0,0 +1,1173 @@
+/* $Id$
+
+   journal.c: reading and writing journal files
+
+
+   Copyright (c) 2026, Yoichi Hariguchi
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+       o Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+       o Redistributions in binary form must reproduce the above
+         copyright notice, this list of conditions and the following
+         disclaimer in the documentation and/or other materials provided
+         with the distribution.
+       o Neither the name of the Yoichi Hariguchi nor the names of its
+         contributors may be used to endorse or promote products derived
+         from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "string-rbt.h"
+#include "backupfs.h"
+#include "error.h"
+
+
+/* Journal file format (version 4, host byte order):
+
+     jnlHeader
+     string table   NUL terminated directory path names and file
+                    base names, padded to 8 bytes
+     dir table      uint32_t[jnlHeader.dirCount]: offset of each
+                    directory path name in the string table,
+                    padded to 8 bytes
+     journalEntry[] fixed width records; journalEntry.dir is the
+                    index in the dir table and journalEntry.name
+                    the offset of the base name in the string table
+
+   Each directory path name is stored once, so a file costs its
+   base name and a record. The writer appends names to the
+   journal file as the tree is walked and keeps the records in
+   a temporary file; closeJournal() appends the dir table and
+   the records and fills in the header. jnlSorted is set in the
+   header if the records happen to be in pathCmp() order, which
+   is the case after a sorted walk. jnlStat is set if the records
+   carry size, inode, device and nanoseconds (version 4).
+
+   Versions 1 and 2 store the full path name of each file
+   (oldJournalEntry); version 1 has no jnlHeader.flags. They are
+   split into the current layout when loaded. Version 3 records
+   (v3JournalEntry) only have seconds; they are copied into
+   current records without jnlStat.
+ */
+
+typedef struct {
+    int64_t  ctime;
+    int64_t  mtime;
+    uint64_t path;              /* offset in string table */
+} oldJournalEntry;
+
+typedef struct {
+    int64_t  ctime;
+    int64_t  mtime;
+    uint32_t dir;               /* index in dir table */
+    uint32_t name;              /* offset of base name in string table */
+} v3JournalEntry;
+
+/* State of converting an old journal; see convertBegin().
+ */
+typedef struct {
+    void*    dirs;              /* directory path name -> index + 1 */
+    uint64_t dirMax;            /* size of jnlImage.dir */
+} jnlConv;
+
+/* A piece of a text journal parsed by one thread
+ */
+typedef struct {
+    char*            map;       /* text journal (string table) */
+    char*            beg;       /* first line */
+    char*            end;       /* past the last line */
+    char*            path;      /* journal file path name */
+    oldJournalEntry* ent;       /* malloc()ed records */
+    uint64_t         count;     /* # of records */
+} textChunk;
+
+enum {
+    jnlHdrSizeV1 = offsetof(jnlHeader, flags),
+    jnlHdrSizeV2 = offsetof(jnlHeader, dirOff),
+    minChunkSize = 1 << 20,     /* smallest text journal chunk per thread */
+};
+
+
+/* Return the next character of the path name `*p'/`*name'
+   (or just `*p' if `*name' is NULL), or '\0' at the end.
+ */
+static inline int
+pathNext (const char** p, const char** name)
+{
+    if (**p) return (unsigned char)*(*p)++;
+    if (*name) {
+        *p = *name;
+        *name = NULL;
+        return '/';
+    }
+    return 0;
+}
+
+
+/* Compare path names component by component: `/' sorts before
+   any other character, so "a/b" < "a.b". This is the order in
+   which dirwalk() visits files when info->sorted is set.
+   A path name is either `dir'/`name', or `dir' if `name' is NULL.
+ */
+static int
+pathCmp (const char* adir, const char* aname,
+         const char* bdir, const char* bname)
+{
+    int c, d;
+
+
+    do {
+        c = pathNext(&adir, &aname);
+        d = pathNext(&bdir, &bname);
+    } while (c == d && c);
+    c = (c == '/') ? 1 : c;
+    d = (d == '/') ? 1 : d;
+    return c - d;
+}
+
+
+/* Hash of a file in directory # `dir' for the journal index.
+ */
+static uint64_t
+entHash (uint32_t dir, const char* name)
+{
+    uint64_t h = 14695981039346656037ULL;
+    int      i;
+
+
+    for (i = 0; i < 4; ++i, dir >>= 8) {
+        h ^= dir & 0xff;
+        h *= 1099511628211ULL;
+    }
+    for (; *name; ++name) {
+        h ^= (unsigned char)*name;
+        h *= 1099511628211ULL;
+    }
+    return h ^ (h >> 32);
+}
+
+
+/* Hash of a file by device and inode for the inode index.
+ */
+static uint64_t
+inoHash (uint64_t dev, uint64_t ino)
+{
+    uint64_t h = (dev * 0x9e3779b97f4a7c15ULL) ^ ino;
+
+
+    h *= 0xc2b2ae3d27d4eb4fULL;
+    return h ^ (h >> 29);
+}
+
+
+static void
+jwriteExit (void* p, size_t len, FILE* fp, char* file, bkupInfo* info)
+{
+    if (fwrite(p, 1, len, fp) < len) {
+        errSysRet(("fwrite(%s)", file));
+        backupfsExit(info, 1);
+    }
+}
+
+
+/* Write `s' to the string table of the new journal.
+   Return its offset.
+ */
+static uint32_t
+jwriteString (const char* s, bkupInfo* info)
+{
+    jnlWriter* jw = info->jw;
+    size_t     len = strlen(s) + 1;
+    uint64_t   off = jw->strSize;
+
+
+    if (off + len > UINT32_MAX) {
+        errRet(("%s: string table too large", info->jpath));
+        backupfsExit(info, 1);
+    }
+    jwriteExit((void*)s, len, info->jnl, info->jpath, info);
+    jw->strSize += len;
+    return off;
+}
+
+
+/* Return the index of directory `dir' in the new journal,
+   adding it to the string and dir tables if it is new.
+ */
+static uint32_t
+jwriteDir (char* dir, bkupInfo* info)
+{
+    jnlWriter* jw = info->jw;
+    uintptr_t  d;
+    uint32_t*  p;
+
+
+    d = (uintptr_t)stringRBTfind(jw->dirs, dir);
+    if (d) return d - 1;
+
+    if (jw->dirCount == jw->dirMax) {
+        jw->dirMax = jw->dirMax ? 2 * jw->dirMax : 1024;
+        p = realloc(jw->dir, jw->dirMax * sizeof(*p));
+        if (!p) {
+            errSysRet(("realloc(%s: %llu dirs)", info->jpath,
+                       (unsigned long long)jw->dirMax));
+            backupfsExit(info, 1);
+        }
+        jw->dir = p;
+    }
+    jw->dir[jw->dirCount] = jwriteString(dir, info);
+    d = ++jw->dirCount;
+    if (stringRBTinsert(jw->dirs, dir, (void*)d)) {
+        errRet(("stringRBTinsert(%s)", dir));
+        backupfsExit(info, 1);
+    }
+    return d - 1;
+}
+
+
+/* Open info->jpath for writing and set up info->jw.
+   Return 1 if success, 0 otherwise.
+ */
+int
+openJournal (bkupInfo* info)
+{
+    jnlHeader  hdr;
+    jnlWriter* jw;
+
+
+    assert(info);
+    assert(info->jpath);
+
+    jw = calloc(1, sizeof(*jw));
+    if (!jw) {
+        errSysRet(("calloc(%d)", sizeof(*jw)));
+        return 0;
+    }
+    info->jw = jw;
+    jw->dirs = stringRBTcreate();
+    if (!jw->dirs) {
+        errRet(("stringRBTcreate() failed"));
+        return 0;
+    }
+    jw->rpath = malloc(strlen(JNL_REC_FILE) + 1);
+    if (!jw->rpath) {
+        errSysRet(("malloc(%d)", strlen(JNL_REC_FILE) + 1));
+        return 0;
+    }
+    strcpy(jw->rpath, JNL_REC_FILE);
+    jw->rec = makeTemp(jw->rpath, "w+");
+    if (!jw->rec) {
+        errRet(("can't make temporary file (%s)", jw->rpath));
+        return 0;
+    }
+    if (unlink(jw->rpath)) {    /* gone when closed */
+        errSysRet(("unlink(%s)", jw->rpath));
+    }
+
+    info->jnl = fopen(info->jpath, "w");
+    if (!info->jnl) {
+        errSysRet(("fopen(%s)", info->jpath));
+        return 0;
+    }
+    /* Placeholder. The real header is written by closeJournal().
+     */
+    memset(&hdr, 0, sizeof(hdr));
+    if (fwrite(&hdr, sizeof(hdr), 1, info->jnl) != 1) {
+        errSysRet(("fwrite(%s)", info->jpath));
+        return 0;
+    }
+    return 1;
+}
+
+
+/* Add `dir'/`file' with info->ctime, info->mtime and the
+   rest of info->stbuf to the new journal.
+ */
+void
+writeJournal (char* dir, char* file, bkupInfo* info)
+{
+    journalEntry ent;
+    jnlWriter*   jw;
+    size_t       dlen;
+    size_t       len;
+
+
+    assert(dir);
+    assert(file);
+    assert(info);
+    assert(info->jnl);
+    assert(info->jw);
+    assert(info->stbuf);
+
+    jw = info->jw;
+    memset(&ent, 0, sizeof(ent));
+    ent.ctime   = info->ctime;
+    ent.mtime   = info->mtime;
+    ent.ctimeNs = info->stbuf->st_ctim.tv_nsec;
+    ent.mtimeNs = info->stbuf->st_mtim.tv_nsec;
+    ent.size    = info->stbuf->st_size;
+    ent.ino     = info->stbuf->st_ino;
+    ent.dev     = info->stbuf->st_dev;
+
+    lockOutput(info);
+    ent.dir  = jwriteDir(dir, info);
+    ent.name = jwriteString(file, info);
+    jwriteExit(&ent, sizeof(ent), jw->rec, jw->rpath, info);
+    ++jw->count;
+    if (!jw->unsorted) {
+        dlen = strlen(dir);
+        len  = dlen + strlen(file) + 2;
+        if (jw->count > 1 && pathCmp(jw->last, NULL, dir, file) >= 0) {
+            jw->unsorted = 1;
+        } else if (len > jw->lastSize) {
+            free(jw->last);
+            jw->lastSize = 2 * len;
+            jw->last = malloc(jw->lastSize);
+            if (!jw->last) {
+                errSysRet(("malloc(%d)", jw->lastSize));
+                jw->unsorted = 1;
+            }
+        }
+        if (!jw->unsorted) {
+            memcpy(jw->last, dir, dlen);
+            jw->last[dlen] = '/';
+            strcpy(jw->last + dlen + 1, file);
+        }
+    }
+    unlockOutput(info);
+}
+
+
+/* Append the dir table and the records to the journal,
+   write the header, and close the journal.
+   Return 1 if success, 0 otherwise.
+ */
+int
+closeJournal (bkupInfo* info)
+{
+    static char pad[8];
+    jnlHeader   hdr;
+    jnlWriter*  jw;
+    char        buf[MAXCHARS * 16];
+    size_t      len;
+    int         rv = 0;
+
+
+    assert(info);
+    assert(info->jnl);
+
+    jw = info->jw;
+    if (!jw || !jw->rec) goto closeReturn;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, JNL_MAGIC, sizeof(hdr.magic));
+    hdr.version  = jnlVersion;
+    hdr.recSize  = sizeof(journalEntry);
+    hdr.count    = jw->count;
+    hdr.strOff   = sizeof(hdr);
+    hdr.strSize  = jw->strSize;
+    hdr.dirOff   = hdr.strOff + ((hdr.strSize + 7) & ~(uint64_t)7);
+    hdr.dirCount = jw->dirCount;
+    hdr.recOff   = hdr.dirOff +
+                   ((hdr.dirCount * sizeof(uint32_t) + 7) & ~(uint64_t)7);
+    hdr.flags    = jw->unsorted ? jnlStat : (jnlSorted | jnlStat);
+
+    len = hdr.dirOff - hdr.strOff - hdr.strSize;
+    if (len && fwrite(pad, 1, len, info->jnl) != len) {
+        errSysRet(("fwrite(%s)", info->jpath));
+        goto closeReturn;
+    }
+    len = hdr.dirCount * sizeof(uint32_t);
+    if (len && fwrite(jw->dir, 1, len, info->jnl) != len) {
+        errSysRet(("fwrite(%s: dir table)", info->jpath));
+        goto closeReturn;
+    }
+    len = hdr.recOff - hdr.dirOff - len;
+    if (len && fwrite(pad, 1, len, info->jnl) != len) {
+        errSysRet(("fwrite(%s)", info->jpath));
+        goto closeReturn;
+    }
+    if (fflush(jw->rec) || fseek(jw->rec, 0, SEEK_SET)) {
+        errSysRet(("fseek(%s)", jw->rpath));
+        goto closeReturn;
+    }
+    while ((len = fread(buf, 1, sizeof(buf), jw->rec)) > 0) {
+        if (fwrite(buf, 1, len, info->jnl) != len) {
+            errSysRet(("fwrite(%s)", info->jpath));
+            goto closeReturn;
+        }
+    }
+    if (ferror(jw->rec)) {
+        errSysRet(("fread(%s)", jw->rpath));
+        goto closeReturn;
+    }
+    if (fseek(info->jnl, 0, SEEK_SET) ||
+        fwrite(&hdr, sizeof(hdr), 1, info->jnl) != 1) {
+        errSysRet(("fwrite(%s: header)", info->jpath));
+        goto closeReturn;
+    }
+    rv = 1;
+
+closeReturn:
+    if (fclose(info->jnl)) {
+        errSysRet(("fclose(jnl)"));
+        rv = 0;
+    }
+    info->jnl = NULL;
+    if (jw) {
+        if (jw->rec) fclose(jw->rec);
+        if (jw->dirs) stringRBTdestroy(jw->dirs);
+        free(jw->dir);
+        free(jw->rpath);
+        free(jw->last);
+        free(jw);
+        info->jw = NULL;
+    }
+    return rv;
+}
+
+
+/* Split the full path names of a version 1 or 2 journal (or of
+   a text journal) into directory and base names, and build the
+   version 3 records and dir table in malloc()ed memory. The
+   mapping is private, so path names are split in place.
+   convertBegin() is followed by convertJournal() for each array
+   of old records, and convertEnd().
+ */
+static int
+convertBegin (jnlImage* img, jnlConv* cv, uint64_t n, char* path)
+{
+    memset(cv, 0, sizeof(*cv));
+    if (img->strSize > UINT32_MAX) {
+        errRet(("%s: journal too large", path));
+        return 0;
+    }
+    img->ent = malloc((n ? n : 1) * sizeof(*img->ent));
+    if (!img->ent) {
+        errSysRet(("malloc(%s: %llu entries)", path, (unsigned long long)n));
+        return 0;
+    }
+    img->entAlloc = 1;
+    img->dirAlloc = 1;
+    img->count    = 0;
+    cv->dirs = stringRBTcreate();
+    if (!cv->dirs) {
+        errRet(("stringRBTcreate() failed"));
+        return 0;
+    }
+    return 1;
+}
+
+
+static void
+convertEnd (jnlConv* cv)
+{
+    if (cv->dirs) stringRBTdestroy(cv->dirs);
+    cv->dirs = NULL;
+}
+
+
+/* Append `n' old records to img->ent.
+ */
+static int
+convertJournal (jnlImage* img, jnlConv* cv, oldJournalEntry* old, uint64_t n,
+                char* path)
+{
+    journalEntry* ent;
+    uint32_t*     tbl;
+    uint64_t      i;
+    uintptr_t     d;
+    char*         p;
+    char*         slash;
+
+
+    ent = img->ent + img->count;
+    for (i = 0; i < n; ++i) {
+        if (old[i].path >= img->strSize) {
+            errRet(("%s: broken record (%llu)", path, (unsigned long long)i));
+            return 0;
+        }
+        p = img->str + old[i].path;
+        slash = strrchr(p, '/');
+        if (!slash) {
+            errRet(("%s: not a full path name (%s)", path, p));
+            continue;
+        }
+        *slash = '\0';
+        d = (uintptr_t)stringRBTfind(cv->dirs, p);
+        if (!d) {
+            if (img->dirCount == cv->dirMax) {
+                cv->dirMax = cv->dirMax ? 2 * cv->dirMax : 1024;
+                tbl = realloc(img->dir, cv->dirMax * sizeof(*tbl));
+                if (!tbl) {
+                    errSysRet(("realloc(%s: %llu dirs)", path,
+                               (unsigned long long)cv->dirMax));
+                    return 0;
+                }
+                img->dir = tbl;
+            }
+            img->dir[img->dirCount] = p - img->str;
+            d = ++img->dirCount;
+            if (stringRBTinsert(cv->dirs, p, (void*)d)) {
+                errRet(("stringRBTinsert(%s)", p));
+                return 0;
+            }
+        }
+        memset(ent, 0, sizeof(*ent));
+        ent->ctime = old[i].ctime;
+        ent->mtime = old[i].mtime;
+        ent->dir   = d - 1;
+        ent->name  = slash + 1 - img->str;
+        ++ent;
+    }
+    img->count = ent - img->ent;
+    return 1;
+}
+
+
+/* Map a binary journal. The string table, the dir table and
+   the records of a version 3 journal are used in place;
+   nothing is parsed. Older versions are converted.
+ */
+static int
+mapBinJournal (jnlImage* img, struct stat* pst, char* path)
+{
+    jnlHeader* hdr;
+    uint64_t   size = pst->st_size;
+    uint64_t   hsize;
+    uint64_t   rsize;
+    uint64_t   i;
+    jnlConv    cv;
+    v3JournalEntry* v3;
+    int        rv;
+
+
+    if (size < jnlHdrSizeV1) {
+        errRet(("%s: truncated journal", path));
+        return 0;
+    }
+    hdr = (jnlHeader*)img->map;
+    switch (hdr->version) {
+    case 1:
+        hsize = jnlHdrSizeV1;
+        rsize = sizeof(oldJournalEntry);
+        break;
+    case 2:
+        hsize = jnlHdrSizeV2;
+        rsize = sizeof(oldJournalEntry);
+        break;
+    case 3:
+        hsize = sizeof(*hdr);
+        rsize = sizeof(v3JournalEntry);
+        break;
+    case jnlVersion:
+        hsize = sizeof(*hdr);
+        rsize = sizeof(journalEntry);
+        break;
+    default:
+        errRet(("%s: unsupported journal version (%u)", path, hdr->version));
+        return 0;
+    }
+    if (size < hsize ||
+        hdr->recSize != rsize ||
+        hdr->strOff < hsize ||
+        hdr->strOff + hdr->strSize > hdr->recOff ||
+        (hdr->recOff & 7) ||
+        hdr->recOff > size ||
+        hdr->count > (size - hdr->recOff) / rsize ||
+        (hdr->strSize && img->map[hdr->strOff + hdr->strSize - 1])) {
+        errRet(("%s: broken journal header", path));
+        return 0;
+    }
+    img->str     = img->map + hdr->strOff;
+    img->strSize = hdr->strSize;
+    img->flags   = (hdr->version >= 2) ? hdr->flags : 0;
+    if (hdr->version < 3) {
+        rv = convertBegin(img, &cv, hdr->count, path) &&
+             convertJournal(img, &cv,
+                            (oldJournalEntry*)(img->map + hdr->recOff),
+                            hdr->count, path);
+        convertEnd(&cv);
+        return rv;
+    }
+
+    if (hdr->dirOff < hdr->strOff + hdr->strSize ||
+        (hdr->dirOff & 3) ||
+        hdr->dirCount > (hdr->recOff - hdr->dirOff) / sizeof(uint32_t)) {
+        errRet(("%s: broken journal header", path));
+        return 0;
+    }
+    img->dir      = (uint32_t*)(img->map + hdr->dirOff);
+    img->dirCount = hdr->dirCount;
+    img->ent      = (journalEntry*)(img->map + hdr->recOff);
+    img->count    = hdr->count;
+    if (hdr->version == 3) {
+        v3 = (v3JournalEntry*)(img->map + hdr->recOff);
+        img->ent = calloc(img->count ? img->count : 1, sizeof(*img->ent));
+        if (!img->ent) {
+            errSysRet(("calloc(%s: %llu entries)", path,
+                       (unsigned long long)img->count));
+            return 0;
+        }
+        img->entAlloc = 1;
+        img->flags &= ~jnlStat;
+        for (i = 0; i < img->count; ++i) {
+            img->ent[i].ctime = v3[i].ctime;
+            img->ent[i].mtime = v3[i].mtime;
+            img->ent[i].dir   = v3[i].dir;
+            img->ent[i].name  = v3[i].name;
+        }
+    }
+    for (i = 0; i < img->dirCount; ++i) {
+        if (img->dir[i] >= img->strSize) {
+            errRet(("%s: broken dir table (%llu)", path,
+                    (unsigned long long)i));
+            return 0;
+        }
+    }
+    for (i = 0; i < img->count; ++i) {
+        if (img->ent[i].dir >= img->dirCount ||
+            img->ent[i].name >= img->strSize) {
+            errRet(("%s: broken record (%llu)", path, (unsigned long long)i));
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/* Decode 8 hex digits at `p'. Return 1 if success.
+ */
+static inline int
+hex8 (const char* p, int64_t* v)
+{
+    uint64_t x = 0;
+    int      c;
+    int      i;
+
+
+    for (i = 0; i < 8; ++i) {
+        c = (unsigned char)p[i];
+        if (c >= '0' && c <= '9') {
+            c -= '0';
+        } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+            c = (c | 0x20) - 'a' + 10;
+        } else {
+            return 0;
+        }
+        x = (x << 4) | c;
+    }
+    *v = x;
+    return 1;
+}
+
+
+/* Parse the lines of one chunk of a text journal into
+   chunk->ent. Run by mapTextJournal() threads.
+ */
+static void*
+parseChunk (void* arg)
+{
+    textChunk*       chunk = arg;
+    oldJournalEntry* ent;
+    char*            p;
+    char*            nl;
+    uint64_t         n;
+
+
+    for (n = 0, p = chunk->beg; p < chunk->end; p = nl + 1, ++n) {
+        nl = memchr(p, '\n', chunk->end - p);
+        if (!nl) nl = chunk->end;
+    }
+    chunk->ent = malloc((n ? n : 1) * sizeof(*chunk->ent));
+    if (!chunk->ent) {
+        errSysRet(("malloc(%s: %llu entries)", chunk->path,
+                   (unsigned long long)n));
+        return NULL;
+    }
+
+    ent = chunk->ent;
+    for (p = chunk->beg; p < chunk->end; p = nl + 1) {
+        /* The end of the map ends an unterminated last line;
+           makeJournalTree() leaves a byte to spare there.
+         */
+        nl = memchr(p, '\n', chunk->end - p);
+        if (!nl) nl = chunk->end;
+        *nl = '\0';
+        /* "%08lx %08lx " is fixed width unless a time does
+           not fit in 32 bits.
+         */
+        if (nl - p > 18 && p[8] == ' ' && p[17] == ' ' &&
+            hex8(p, &ent->ctime) && hex8(p + 9, &ent->mtime)) {
+            p += 17;
+        } else {
+            ent->ctime = strtol(p, &p, 16);
+            ent->mtime = strtol(p, &p, 16);
+            if (*p != ' ') {
+                errRet(("%s: broken line (%s)", chunk->path, p));
+                continue;
+            }
+        }
+        ent->path  = ++p - chunk->map;
+        ++ent;
+    }
+    chunk->count = ent - chunk->ent;
+    return NULL;
+}
+
+
+/* Old text journal: "%08lx %08lx path\n" per file.
+   Terminate path names in place, so that the mapping itself
+   becomes the string table, and convert the records. Large
+   journals are split at newlines and parsed by `nthreads'
+   threads.
+   The next journal is written in binary.
+ */
+static int
+mapTextJournal (jnlImage* img, struct stat* pst, char* path, int nthreads)
+{
+    textChunk chunk[maxWalkThreads];
+    pthread_t tid[maxWalkThreads];
+    int       started[maxWalkThreads];
+    jnlConv   cv;
+    uint64_t  size = pst->st_size;
+    uint64_t  n;
+    char*     beg;
+    char*     end;
+    char*     nl;
+    int       i;
+    int       rv = 0;
+
+
+    img->str     = img->map;
+    img->strSize = size;
+
+    if (nthreads > maxWalkThreads) nthreads = maxWalkThreads;
+    if (nthreads > size / minChunkSize) nthreads = size / minChunkSize;
+    if (nthreads < 1) nthreads = 1;
+
+    memset(chunk, 0, sizeof(chunk));
+    end = img->map + size;
+    beg = img->map;
+    for (i = 0; i < nthreads; ++i) {
+        chunk[i].map  = img->map;
+        chunk[i].path = path;
+        chunk[i].beg  = beg;
+        if (i == nthreads - 1) {
+            chunk[i].end = end;
+        } else {
+            nl = img->map + size / nthreads * (i + 1);
+            if (nl < beg) nl = beg;
+            nl = memchr(nl, '\n', end - nl);
+            chunk[i].end = nl ? nl + 1 : end;
+        }
+        beg = chunk[i].end;
+    }
+    for (i = 1; i < nthreads; ++i) {
+        started[i] = !pthread_create(&tid[i], NULL, parseChunk, &chunk[i]);
+    }
+    parseChunk(&chunk[0]);
+    for (i = 1; i < nthreads; ++i) {
+        if (started[i]) {
+            pthread_join(tid[i], NULL);
+        } else {
+            parseChunk(&chunk[i]);
+        }
+    }
+
+    for (n = 0, i = 0; i < nthreads; ++i) {
+        if (!chunk[i].ent) goto freeReturn;
+        n += chunk[i].count;
+    }
+    if (convertBegin(img, &cv, n, path)) {
+        for (i = 0; i < nthreads; ++i) {
+            if (!convertJournal(img, &cv, chunk[i].ent, chunk[i].count, path)) {
+                break;
+            }
+        }
+        rv = (i == nthreads);
+    }
+    convertEnd(&cv);
+
+freeReturn:
+    for (i = 0; i < nthreads; ++i) {
+        free(chunk[i].ent);
+    }
+    return rv;
+}
+
+
+/* Build img->inoSlot. Moved files are only copied again
+   without it, so running out of memory is not an error.
+ */
+static void
+makeInodeIndex (jnlImage* img, char* path)
+{
+    journalEntry* ent;
+    uint64_t      size;
+    uint64_t      i;
+    uint64_t      h;
+
+
+    for (size = 1024; size * 3 < img->count * 4; size *= 2)
+        ;                       /* at most 3/4 full */
+    img->inoSlot = calloc(size, sizeof(*img->inoSlot));
+    if (!img->inoSlot) {
+        errSysRet(("calloc(%s: %llu inode slots)", path,
+                   (unsigned long long)size));
+        return;
+    }
+    img->inoMask = size - 1;
+    for (i = 0, ent = img->ent; i < img->count; ++i, ++ent) {
+        h = inoHash(ent->dev, ent->ino) & img->inoMask;
+        while (img->inoSlot[h]) {
+            h = (h + 1) & img->inoMask;
+        }
+        img->inoSlot[h] = i + 1;
+    }
+}
+
+
+/* Map info->oldJpath (binary or text) and build the journal
+   index: info->jt maps directory path names to their index in
+   the dir table, and img->slot is a hash table of the records
+   keyed by directory index and base name. No index is built
+   if info->sorted is set and the journal is sorted; the journal
+   is then merged with the walk by matchJournal(). img->inoSlot
+   indexes the records by device and inode for findMoved() if
+   the journal has them.
+   Return 1 if success, 0 otherwise.
+ */
+int
+makeJournalTree (bkupInfo* info)
+{
+    struct stat   stbuf;
+    jnlImage*     img;
+    journalEntry* ent;
+    uint64_t      size;
+    uint64_t      i;
+    uint64_t      h;
+    int           fd;
+    int           rv;
+
+
+    assert(info);
+    assert(info->oldJpath);
+
+    img = calloc(1, sizeof(*img));
+    if (!img) {
+        errSysRet(("calloc(%d)", sizeof(*img)));
+        return 0;
+    }
+    info->ojnl = img;
+    fd = open(info->oldJpath, O_RDONLY);
+    if (fd < 0) {
+        errSysRet(("open(%s)", info->oldJpath));
+        return 0;
+    }
+    if (fstat(fd, &stbuf)) {
+        errSysRet(("fstat(%s)", info->oldJpath));
+        close(fd);
+        return 0;
+    }
+    if (stbuf.st_size > 0) {
+        /* One spare byte past the file, so that a text journal
+           whose last line lacks its newline can still be
+           terminated in place. Past EOF the file page reads as
+           zeros; a page-aligned file gets an anonymous page.
+         */
+        img->map = mmap(NULL, stbuf.st_size + 1, PROT_READ|PROT_WRITE,
+                        MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (img->map == MAP_FAILED) {
+            errSysRet(("mmap(%s)", info->oldJpath));
+            img->map = NULL;
+            close(fd);
+            return 0;
+        }
+        img->mapLen = stbuf.st_size + 1;
+        if (mmap(img->map, stbuf.st_size, PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_FIXED, fd, 0) == MAP_FAILED) {
+            errSysRet(("mmap(%s)", info->oldJpath));
+            close(fd);
+            return 0;
+        }
+    }
+    close(fd);
+
+    if (stbuf.st_size >= sizeof(JNL_MAGIC) &&
+        !memcmp(img->map, JNL_MAGIC, sizeof(JNL_MAGIC))) {
+        rv = mapBinJournal(img, &stbuf, info->oldJpath);
+    } else {
+        rv = mapTextJournal(img, &stbuf, info->oldJpath, walkThreads(info));
+    }
+    if (!rv) return 0;
+    if (img->count >= UINT32_MAX) {
+        errRet(("%s: too many records", info->oldJpath));
+        return 0;
+    }
+    if (img->flags & jnlStat) {
+        makeInodeIndex(img, info->oldJpath);
+    }
+
+    if (info->sorted) {
+        if (img->flags & jnlSorted) return 1;
+        printf("%s: journal not sorted. Using journal tree this time\n",
+               info->oldJpath);
+    }
+    info->jt = stringRBTcreate();
+    if (!info->jt) {
+        errRet(("stringRBTcreate() failed"));
+        return 0;
+    }
+    for (i = 0; i < img->dirCount; ++i) {
+        if (stringRBTinsert(info->jt, img->str + img->dir[i],
+                            (void*)(uintptr_t)(i + 1))) {
+            errRet(("stringRBTinsert(%s)", img->str + img->dir[i]));
+            return 0;
+        }
+    }
+
+    for (size = 1024; size * 3 < img->count * 4; size *= 2)
+        ;                       /* at most 3/4 full */
+    img->slot = calloc(size, sizeof(*img->slot));
+    if (!img->slot) {
+        errSysRet(("calloc(%s: %llu slots)", info->oldJpath,
+                   (unsigned long long)size));
+        return 0;
+    }
+    img->mask = size - 1;
+    for (i = 0, ent = img->ent; i < img->count; ++i, ++ent) {
+        h = entHash(ent->dir, img->str + ent->name) & img->mask;
+        while (img->slot[h]) {
+            h = (h + 1) & img->mask;
+        }
+        img->slot[h] = i + 1;
+    }
+    return 1;
+}
+
+
+/* Free the journal index in one go and unmap the old journal.
+ */
+void
+freeJournalTree (bkupInfo* info)
+{
+    jnlImage* img;
+
+
+    assert(info);
+
+    if (info->jt) {
+        stringRBTdestroy(info->jt);
+        info->jt = NULL;
+    }
+    img = info->ojnl;
+    if (!img) return;
+    free(img->slot);
+    free(img->inoSlot);
+    if (img->entAlloc) free(img->ent);
+    if (img->dirAlloc) free(img->dir);
+    if (img->map && munmap(img->map, img->mapLen)) {
+        errSysRet(("munmap(%s)", info->oldJpath));
+    }
+    free(img);
+    info->ojnl = NULL;
+}
+
+
+/* Compare the path name of record `ent' with `dir'/`file'.
+ */
+static inline int
+entCmp (jnlImage* img, journalEntry* ent, char* dir, char* file)
+{
+    return pathCmp(img->str + img->dir[ent->dir], img->str + ent->name,
+                   dir, file);
+}
+
+
+/* Find `dir'/`file' in the old journal in any order.
+   Return NULL if not found.
+ */
+journalEntry*
+findJournal (char* dir, char* file, bkupInfo* info)
+{
+    jnlImage*     img = info->ojnl;
+    journalEntry* ent;
+    uintptr_t     d;
+    uint64_t      lo, hi, mid;
+    uint64_t      h;
+    int           cmp;
+
+
+    assert(dir);
+    assert(file);
+    assert(img);
+
+    if (info->jt) {
+        d = (uintptr_t)stringRBTfind(info->jt, dir);
+        if (!d--) return NULL;
+        h = entHash(d, file) & img->mask;
+        for (; img->slot[h]; h = (h + 1) & img->mask) {
+            ent = &img->ent[img->slot[h] - 1];
+            if (ent->dir == d && !strcmp(img->str + ent->name, file)) {
+                return ent;
+            }
+        }
+        return NULL;
+    }
+
+    lo = 0;
+    hi = img->count;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        cmp = entCmp(img, &img->ent[mid], dir, file);
+        if (cmp == 0) return &img->ent[mid];
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+
+/* Find `dir'/`file' in the old journal. Without a journal
+   index, files must come in pathCmp() order (info->sorted):
+   the journal is read once from the top as the walk proceeds.
+   Return NULL if not found.
+ */
+journalEntry*
+matchJournal (char* dir, char* file, bkupInfo* info)
+{
+    jnlImage* img = info->ojnl;
+    int       cmp;
+
+
+    assert(dir);
+    assert(file);
+    assert(img);
+
+    if (info->jt) return findJournal(dir, file, info);
+
+    while (img->cur < img->count) {
+        cmp = entCmp(img, &img->ent[img->cur], dir, file);
+        if (cmp > 0) break;     /* `dir'/`file' is a new file */
+        ++img->cur;             /* cmp < 0: removed since last backup */
+        if (cmp == 0) return &img->ent[img->cur - 1];
+    }
+    return NULL;
+}
+
+
+/* Find the file in info->stbuf in the old journal by device,
+   inode, size and mtime: it was moved or renamed since the last
+   backup. Set *dir and *file to its path name in the journal.
+   Return NULL if not found.
+ */
+journalEntry*
+findMoved (char** dir, char** file, bkupInfo* info)
+{
+    jnlImage*     img = info->ojnl;
+    struct stat*  st = info->stbuf;
+    journalEntry* ent;
+    uint64_t      h;
+
+
+    assert(dir);
+    assert(file);
+    assert(img);
+    assert(st);
+
+    if (!img->inoSlot) return NULL;
+    h = inoHash(st->st_dev, st->st_ino) & img->inoMask;
+    for (; img->inoSlot[h]; h = (h + 1) & img->inoMask) {
+        ent = &img->ent[img->inoSlot[h] - 1];
+        if (ent->dev     == st->st_dev &&
+            ent->ino     == st->st_ino &&
+            ent->size    == st->st_size &&
+            ent->mtime   == st->st_mtime &&
+            ent->mtimeNs == st->st_mtim.tv_nsec) {
+            *dir  = img->str + img->dir[ent->dir];
+            *file = img->str + ent->name;
+            return ent;
+        }
+    }
+    return NULL;
+}
+
+
+/* Return 1 if the file in info->stbuf has not changed since
+   `ent' was recorded. Journals older than version 4 only have
+   seconds, which are all that is compared then. Inode and device
+   numbers are left out: they change when a disk is renumbered
+   or a file system restored, while the file itself does not.
+ */
+int
+isUnchanged (journalEntry* ent, bkupInfo* info)
+{
+    struct stat* st = info->stbuf;
+
+
+    assert(ent);
+    assert(st);
+
+    if (ent->ctime != info->ctime || ent->mtime != info->mtime) return 0;
+    if (!(info->ojnl->flags & jnlStat)) return 1;
+    return ent->ctimeNs == st->st_ctim.tv_nsec &&
+           ent->mtimeNs == st->st_mtim.tv_nsec &&
+           ent->size    == st->st_size;
+}
+
+
+/* Return 1 if the file described by info->stbuf may only have
+   grown since `ent' was written, 0 otherwise.
+ */
+int
+isAppended (journalEntry* ent, bkupInfo* info)
+{
+    struct stat* st = info->stbuf;
+
+
+    assert(ent);
+    assert(st);
+
+    if (!(info->ojnl->flags & jnlStat)) return 0;
+    return S_ISREG(st->st_mode) &&
+           ent->size > 0 &&
+           ent->size < st->st_size &&
+           ent->ino  == st->st_ino &&
+           ent->dev  == st->st_dev;
+}
@@ -55,7 +55,7 @@ static void
 usage (void)
 {
     fprintf(stderr, "%s\n" "Compiled: %s\n"
-            "Usage: %s [[user@]host:]<src-dir> <dst-dir>\n",
+            "Usage: %s [-j threads] [-m] [-u] [-H] [-d store] [-s streams] [[user@]host:]<src-dir> <dst-dir>\n",
             VERSION, CompilationDate, PROGNAME);
     exit(1);
 }
@@ -66,19 +66,62 @@ main (int argc, char* argv[])
 {
     bkupInfo info;
     bkupType type;
+    int      i;
     int      len;
     int      rst;               /* return status */
+    uring*   ring;
 
 
     if (getuid() != ROOT_UID) {
         fprintf(stderr, "must be root\n");
         exit(1);
     }
+    umask(defUmask);
+    memset(&info, 0, sizeof(info));
+
+    for (i = 1; i < argc && argv[i][0] == '-'; ++i) {
+        switch (argv[i][1]) {
+        case 'j':
+            if (++i >= argc) usage();
+            info.nthreads = strtol(argv[i], NULL, 10);
+            break;
+        case 'm':
+            info.sorted = 1;
+            break;
+        case 'u':
+            info.uring = 1;
+            break;
+        case 'H':
+            info.hdd = 1;
+            break;
+        case 'd':
+            if (++i >= argc) usage();
+            info.store = argv[i];
+            if (*info.store != '/') goto errorExit;
+            break;
+        case 's':
+            if (++i >= argc) usage();
+            info.streams = strtol(argv[i], NULL, 10);
+            if (info.streams < 0) usage();
+            break;
+        default:
+            fprintf(stderr, "%s: unknown option\n", argv[i]);
+            exit(1);
+        }
+    }
+    if (info.uring) {
+        ring = uringOpen(1);
+        if (!ring) {
+            fprintf(stderr, "io_uring is not available. -u ignored\n");
+            info.uring = 0;
+        }
+        uringClose(ring);
+    }
+    argc -= i - 1;              /* skip options */
+    argv += i - 1;
     if (argc <= 2) {
         usage();
     }
-    umask(defUmask);
-    memset(&info, 0, sizeof(info));
 
     info.dest = argv[2];
     info.src  = index(argv[1], ':');
@@ -112,8 +155,12 @@ main (int argc, char* argv[])
 
     if (info.host) {
         makeSshKey(&info);
+        openSshMaster(&info);
     }
     chkDest(&info);
+    if (info.store && !storeOpen(&info)) {
+        errExit(("can't open content store (%s)", info.store));
+    }
     if (info.host) {
         exit(doRemote(&info));
     }
@@ -133,11 +180,11 @@ main (int argc, char* argv[])
     }
     rst = dirwalk(info.src, &info);
     closeFiles(&info);
+    freeJournalTree(&info);
     if ((type == bkupRecurrent) && unlink(info.oldJpath)) {
         errSysRet(("unlink(%s)", info.oldJpath));
     }
-    rst = runCommands(&info);
-    removeFiles(&info);
+    rst = copyFinish(&info);
     if (type == bkupFirstTime && !rst) {
         if (info.jpath && unlink(info.jpath)) {
             errSysRet(("unlink(%s)", info.jpath));
@@ -148,7 +195,7 @@ main (int argc, char* argv[])
 
 errorExit:
     fprintf(stderr,
-            "Source and Destination directories must be full path\n");
+            "Source, destination, and store directories must be full path\n");
     exit(1);
     return 0;                   /* to make gcc happy */
 }
@@ -160,7 +207,6 @@ backupfsExit (bkupInfo* info, int exitStatus)
     assert(info);
 
     closeFiles(info);
-    removeFiles(info);
     moveFile(info->oldJpath, info->jpath);
     exit(exitStatus);
 }
@@ -52,7 +52,7 @@ static void
 usage (void)
 {
     fprintf(stderr, "%s\n" "Compiled: %s\n"
-            "Usage: %s <src-dir> <backup-dir> <host> <time-in-hex>\n",
+            "Usage: %s [-m] [-H] [-l | -f] <src-dir> <backup-dir>\n",
                         VERSION, CompilationDate, PROGNAME_REMOTE);
     exit(1);
 }
@@ -63,12 +63,27 @@ main (int argc, char* argv[])
 {
     bkupInfo info;
     bkupType type;
+    int      fetch = 0;         /* -f: send the files listed in stdin */
     int      i;
     int      len;
     int      rst;               /* return status */
 
 
-    if (argc <= 4) {
+    memset(&info, 0, sizeof(info));
+    for ( ; argc > 1 && argv[1][0] == '-'; --argc, ++argv ) {
+        if (!strcmp(argv[1], "-m")) {
+            info.sorted = 1;
+        } else if (!strcmp(argv[1], "-H")) {
+            info.hdd = 1;
+        } else if (!strcmp(argv[1], "-l")) {
+            info.listOnly = 1;
+        } else if (!strcmp(argv[1], "-f")) {
+            fetch = 1;
+        } else {
+            usage();
+        }
+    }
+    if (argc <= 2 || (fetch && info.listOnly)) {
         usage();
     }
     for ( i = 1; i <= 2; ++i ) {
@@ -80,13 +95,16 @@ main (int argc, char* argv[])
     }
 
     umask(defUmask);
-    memset(&info, 0, sizeof(info));
     info.src   = argv[1];
     info.bdir  = argv[2];
     info.blen  = strlen(info.bdir);
-    info.host  = argv[3];
-    info.dest  = argv[4];       /* use info.dest for time string */
-    openFilesRemote(&info);
+    openStream(&info);
+    if (fetch) {
+        sendStart(&info);
+        fetchFiles(stdin, &info);
+        sendFinish(&info);
+        exit(0);
+    }
     type = chkSource(&info);
     openJournalFile(&info);
 
@@ -102,11 +120,14 @@ main (int argc, char* argv[])
         backupfsExit(&info, 1);
     }
     writeDestDir(&info);
+    sendStart(&info);
     rst = dirwalk(info.src, &info);
     if (!rst) {
         errRet(("dirwalk()"));
     }
+    sendFinish(&info);
     closeFiles(&info);
+    freeJournalTree(&info);
     if ((type == bkupRecurrent) && unlink(info.oldJpath)) {
         errSysRet(("unlink(%s)", info.oldJpath));
     }
@@ -126,7 +147,6 @@ backupfsExit (bkupInfo* info, int exitStatus)
     assert(info);
 
     closeFiles(info);
-    removeFiles(info);
-    moveFile(info->oldJpath, info->jpath);
+    if (info->oldJpath) moveFile(info->oldJpath, info->jpath);
     exit(exitStatus);
 }
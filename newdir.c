@@ -1,9 +1,9 @@
-/* $Id: backupfs-exctar.c,v 1.5 2005/04/21 04:46:01 cvsremote Exp $
+/* $Id$
 
-   backupfs-exctar.c: main for bkupfs-exctar (run on remote host)
+   newdir.c: make or update a directory of a remote backup
 
 
-   Copyright (c) 2005, Yoichi Hariguchi
+   Copyright (c) 2026, Yoichi Hariguchi
    All rights reserved.
 
    Redistribution and use in source and binary forms, with or without
@@ -35,48 +35,68 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include "backupfs.h"
 #include "error.h"
 
 
-static char File[MAXCHARS];
-
-
-static void
-usage (void)
-{
-    fprintf(stderr, "%s\n" "Compiled: %s\n"
-            "Usage: %s <host> <time-in-hex>\n",
-            VERSION, CompilationDate, PROGNAME_CHKSRC);
-    exit(1);
-}
-
-
+/* `rec' is "0x<uid> 0x<gid> 0x<mode> <path>" written by
+   newDirectory() of backupfs-remote.
+   Make directory <path>, or set its owner and mode if it exists.
+   Return 1 if succeeded.  Return 0 otherwise.
+ */
 int
-main (int argc, char* argv[])
+makeNewDir (char* rec)
 {
-    int   len;
-    char* host;
-    char* tm;                   /* time in hex */
+    struct stat stbuf;
+    uid_t       uid;
+    gid_t       gid;
+    mode_t      mode;
+    char*       p;
 
 
-    if (argc <= 2) {
-        usage();
-    }
+    assert(rec);
 
-    host = argv[1];
-    tm   = argv[2];
-    len  = sizeof(File);
-    if (snprintf(File, len, RMT_TAR_FILE, host, tm) >= len) {
-        errExit((RMT_TAR_FILE ": file name too long", host, tm));
+    uid  = strtol(rec, &p, 16);
+    gid  = strtol(p, &p, 16);
+    mode = strtol(p, &p, 16);
+    if (*p++ != ' ') {
+        errRet(("%s: wrong directory record", rec));
+        return 0;
+    }
+    if (!stat(p, &stbuf)) {
+        if (!S_ISDIR(stbuf.st_mode)) {
+            errRet(("%s: not a directory", p));
+            return 0;
+        }
+        if (chown(p, uid, gid)) {
+            errSysRet(("chown(%s, 0x%08x, 0x%08x)", p, uid, gid));
+            return 0;
+        }
+        if (chmod(p, mode)) {
+            errSysRet(("chmod(%s, 0x%08x)", p, mode));
+            return 0;
+        }
+    } else if (errno == ENOENT) {
+        if (mkdir(p, mode)) {
+            errSysRet(("mkdir(%s, 0x%08x)", p, mode));
+            return 0;
+        }
+        if (chown(p, uid, gid)) {
+            errSysRet(("chown(%s, 0x%08x, 0x%08x)", p, uid, gid));
+            return 0;
+        }
+    } else {
+        errSysRet(("stat(%s)", p));
+        return 0;
     }
-    exit(execlp("tar", "tar", "-c", "-T", File, "-f", "-", NULL));
+    return 1;
 }
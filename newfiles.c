@@ -45,7 +45,6 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
-#include "string-rbt.h"
 #include "backupfs.h"
 #include "error.h"
 
@@ -69,7 +68,8 @@ usage (char* path, bkupInfo* info)
 
     fprintf(stderr, "%s\n" "Compiled: %s\n"
                                 "Usage: %s ", VERSION, CompilationDate, cmd);
-    fprintf(stderr, "[-l] <src-dir> <backup-root-dir> [yyyy mm dd]\n");
+    fprintf(stderr,
+            "[-l] [-j threads] <src-dir> <backup-root-dir> [yyyy mm dd]\n");
     exit(1);
 }
 
@@ -81,6 +81,13 @@ newDirectory (char* bkupdir, struct stat* pst, bkupInfo* info)
 }
 
 
+void
+backupfsExit (bkupInfo* info, int exitStatus)
+{
+    exit(exitStatus);
+}
+
+
 /* print new or changed file
  */
 void
@@ -108,7 +115,7 @@ showFile (char* dir, char* file, bkupInfo* info)
     strcat(lbpath, "/");
     strcat(lbpath, file);
     path = lbpath + info->lblen;
-    pEnt = stringRBTfind(info->jt, path);
+    pEnt = findJournal(dir + info->lblen, file, info);
     if (info->host) {
         if (!pEnt) goto freeReturn; /* not changed file but new file */
         if (lstat(lbpath, &stbuf)) goto freeReturn;
@@ -122,13 +129,14 @@ showFile (char* dir, char* file, bkupInfo* info)
 
 printReturn:
     if (info->jpath) {
-        info->bdir[info->lblen] = '\0';
+        /* info->bdir is shared by dirwalk() threads; don't
+           truncate it in place.
+         */
         if (info->host) {
-            printf("%s %s%s\n", lbpath, info->bdir, path);
+            printf("%s %.*s%s\n", lbpath, info->lblen, info->bdir, path);
         } else {
-            printf("%s%s\n", info->bdir, path);
+            printf("%.*s%s\n", info->lblen, info->bdir, path);
         }
-        info->bdir[info->lblen] = '/';
     } else {
         printf("%s\n", path);
     }
@@ -157,7 +165,7 @@ setBkupDir (time_t t, bkupInfo* info)
 
     dlen = strlen(info->dest);
     p    = info->dest + dlen;
-    len  = dlen + strlen(info->src) + strlen(BKUP_DIR) + 1;
+    len  = dlen + strlen(info->src) + strlen(BKUP_DIR) + 2; /* `/' and NUL */
     info->bdir = malloc(len);
     if (!info->bdir) errSysExit(("1: malloc(%d)", len));
 
@@ -253,6 +261,10 @@ main (int argc, char* argv[])
         case 'l':
             info.jpath = argv[0] + len; /* use jpath as flag for long format */
             break;
+        case 'j':
+            if (++i >= argc) usage(argv[0], &info);
+            info.nthreads = strtol(argv[i], NULL, 10);
+            break;
         default:
             fprintf(stderr, "%s: unknown option\n", argv[i]);
             exit(1);
@@ -300,6 +312,7 @@ main (int argc, char* argv[])
     if (!dirwalk(info.bdir, &info)) {
         errExit(("failed in dirwalk(%s)", info.bdir));
     }
+    freeJournalTree(&info);
     exit(0);
 
 
@@ -0,0 +1,1662 @@
+/* $Id$
+
+   stream.c: record stream from backupfs-remote to backupfs
+
+
+   Copyright (c) 2026, Yoichi Hariguchi
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+       o Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+       o Redistributions in binary form must reproduce the above
+         copyright notice, this list of conditions and the following
+         disclaimer in the documentation and/or other materials provided
+         with the distribution.
+       o Neither the name of the Yoichi Hariguchi nor the names of its
+         contributors may be used to endorse or promote products derived
+         from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/* A remote backup runs backupfs-remote on the remote host over ssh.
+   It walks the source and writes records to its stdout, and backupfs
+   on the backup server applies them as they arrive.  A record is
+
+       <type><length of data in 8 hex digits><data>
+
+   recTime   last backup time (hex).  First record of a recurrent
+             backup
+   recDir    "0x<uid> 0x<gid> 0x<mode> <path>" of a directory in
+             the backup.  See recvDir()
+   recLink   path name to be hard linked from the last backup, or
+             LINK_MOVED "<new path>\0<old path>" if it was moved
+   recFile   "0x<uid> 0x<gid> 0x<mode> 0x<mtime> 0x<nsec> 0x<rdev>
+             0x<size> <path>" of a file to be copied (+ "\0<target>"
+             if it is a symbolic link)
+   recData   contents of the last recFile; <size> bytes in total.
+             Other records may come between them.  Up to recChunk
+             bytes each, or recMaxLen if spliced
+   recZData  recData deflated with zlib.  The zlib stream goes on
+             across recZData of a file, and restarts at each recFile
+             and recData
+   recSame   "<path>\0<path sent before>": another name of a file
+   recPrint  output of backupfs-remote
+   recQueue  "0x<size> <dev:ino> <path>" of a file to be fetched later
+             (backupfs-remote -l).  <dev:ino> is `-' unless the file
+             has other names
+   recWait   all files are queued.  backupfs-remote -l waits for `1'
+             in its stdin before it ends the stream
+   recEnd    end of the stream.  Anything else is an error
+
+   Directories come before anything in them because dirwalk()
+   calls newDirectory() before it reads them.
+
+   backupfs trusts no path name in the records: they must be under
+   <src-dir> without "." or "..", and are resolved beneath the backup
+   directories without following symbolic links.  Symbolic links are
+   made after the end of the stream.
+
+   With -l, the queued files are split into shards of about the same
+   bytes, and each shard is fetched by backupfs-remote -f over an ssh
+   connection of its own at the same time.  The old journal on the
+   remote host is kept until they are all fetched.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/openat2.h>
+#include <zlib.h>
+
+#include "string-rbt.h"
+#include "backupfs.h"
+#include "error.h"
+
+
+/* File contents are compressed at a level from 0 (not compressed)
+   to zMaxLevel.  After each zWindow bytes run through deflate(), the
+   level goes up if sending took more than twice as long as compressing
+   (slow link), and down if compressing took longer (fast link or busy
+   CPU).  Bytes sent as is (packed files) don't count: they would make
+   compressing look free.  At level 0 it tries level 1 again after
+   zHold windows of any bytes.
+ */
+enum {
+    zWindow   = 1 << 20,
+    zMaxLevel = 9,
+    zHold     = 16,
+};
+
+static pthread_mutex_t streamLock = PTHREAD_MUTEX_INITIALIZER;
+static void*           sentFiles; /* "dev:ino" -> path (st_nlink > 1) */
+static z_stream        zout;      /* used by putFile() only */
+static int             zoutInit;  /* deflateInit() is done */
+static int             zdirty;    /* zout has data since deflateReset() */
+static int             zparam;    /* level zout is set to */
+static int             zlevel = 1;
+static int             zhold;
+static double          zcompT;    /* compressing time in this window */
+static double          zsendT;    /* sending time in this window */
+static size_t          zwin;      /* bytes sent in this window */
+static int             zeroCopy;  /* recData by splice() or sendfile() */
+static int             outPipe;   /* info->stream is a pipe */
+
+/* These are compressed already
+ */
+static const char* packedSuffix[] = {
+    ".gz", ".tgz", ".bz2", ".xz", ".zst", ".lz4", ".lzma", ".z", ".zip",
+    ".7z", ".rar", ".jar", ".apk", ".deb", ".rpm", ".jpg", ".jpeg",
+    ".png", ".gif", ".webp", ".heic", ".mp3", ".mp4", ".m4a", ".m4v",
+    ".mkv", ".webm", ".avi", ".mov", ".ogg", ".opus", ".flac", ".docx",
+    ".xlsx", ".pptx", ".odt", ".ods", ".epub", NULL
+};
+
+
+/* Write a record of `type' whose data is `len' bytes of `s'
+   to info->stream.  Thread safe.
+ */
+void
+putRecord (int type, char* s, size_t len, bkupInfo* info)
+{
+    char hdr[recHdrLen + 1];
+
+
+    assert(info);
+    assert(info->stream);
+    assert(len <= 0xffffffff);
+
+    snprintf(hdr, sizeof(hdr), "%c%08x", type, (unsigned)len);
+    pthread_mutex_lock(&streamLock);
+    if (fwrite(hdr, 1, recHdrLen, info->stream) != recHdrLen ||
+        (len && fwrite(s, 1, len, info->stream) != len)) {
+        errSysRet(("fwrite(stream: %c)", type));
+        pthread_mutex_unlock(&streamLock);
+        backupfsExit(info, 1);
+    }
+    pthread_mutex_unlock(&streamLock);
+}
+
+
+static ssize_t
+printRecord (void* cookie, const char* buf, size_t size)
+{
+    size_t n, len;
+
+
+    for (n = 0; n < size; n += len) {
+        len = (size - n < recChunk) ? size - n : recChunk;
+        putRecord(recPrint, (char*)buf + n, len, cookie);
+    }
+    return size;
+}
+
+
+/* Make stdout of backupfs-remote the stream, and send what is
+   printed afterwards (unchanged:, new file:, ...) as recPrint.
+ */
+void
+openStream (bkupInfo* info)
+{
+    cookie_io_functions_t io = { NULL, printRecord, NULL, NULL };
+    struct stat st;
+    FILE* fp;
+
+
+    assert(info);
+
+    info->stream = stdout;
+    if (!fstat(fileno(stdout), &st)) {
+        outPipe = S_ISFIFO(st.st_mode);
+        if (outPipe) fcntl(fileno(stdout), F_SETPIPE_SZ, pipeSize);
+        zeroCopy = 1;
+    }
+    fp = fopencookie(info, "w", io);
+    if (!fp) errSysExit(("fopencookie(stdout)"));
+    stdout = fp;
+}
+
+
+/* Flush the output of backupfs-remote and end the stream.
+ */
+void
+closeStream (bkupInfo* info)
+{
+    assert(info);
+    assert(info->stream);
+
+    if (fflush(stdout)) errSysRet(("fflush(stdout)"));
+    if (zoutInit) {
+        deflateEnd(&zout);
+        zoutInit = 0;
+    }
+    putRecord(recEnd, NULL, 0, info);
+    if (fflush(info->stream)) errSysExit(("fflush(stream)"));
+}
+
+
+static double
+now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static int
+isPacked (char* path)
+{
+    const char** p;
+    char*        s;
+
+
+    s = rindex(path, '.');
+    if (!s || s < rindex(path, '/')) return 0;
+    for (p = packedSuffix; *p; ++p) {
+        if (!strcasecmp(s, *p)) return 1;
+    }
+    return 0;
+}
+
+
+/* Change the compression level after each zWindow bytes.  `n'
+   bytes were compressed in `comp' seconds and sent in `send'.  Call
+   it for bytes not compressed only at level 0.
+ */
+static void
+adaptLevel (double comp, double send, size_t n)
+{
+    int level = zlevel;
+
+
+    zcompT += comp;
+    zsendT += send;
+    zwin   += n;
+    if (zwin < zWindow) return;
+
+    if (zlevel == 0) {
+        if (--zhold <= 0) zlevel = 1;
+    } else if (zsendT > 2 * zcompT) {
+        if (zlevel < zMaxLevel) ++zlevel;
+    } else if (zcompT > zsendT) {
+        if (--zlevel == 0) zhold = zHold;
+    }
+    if (zlevel != level && isDebugOn()) {
+        dbgInfo(("compression level %d (compress %.3fs, send %.3fs)",
+                 zlevel, zcompT, zsendT));
+    }
+    zcompT = zsendT = 0;
+    zwin   = 0;
+}
+
+
+/* Send `n' bytes of `buf' as recZData if compressing them saves
+   1/16 or more, or as recData otherwise.  If the first chunk of a
+   file doesn't shrink, `*packed' is set and the rest is sent as is.
+ */
+static void
+putData (char* buf, size_t n, int first, int* packed, bkupInfo* info)
+{
+    static char zbuf[recChunk + 1024];
+    double      t0, t1, t2;
+    size_t      len = 0;
+    int         deflated = 0;
+    int         rc;
+
+
+    t0 = now();
+    if (zlevel > 0 && !*packed) {
+        if (!zoutInit) {
+            if (deflateInit(&zout, zlevel) != Z_OK) {
+                errRet(("deflateInit: %s", zout.msg ? zout.msg : ""));
+                zlevel = 0;
+                zhold  = INT32_MAX;
+                goto sendData;
+            }
+            zoutInit = 1;
+            zparam   = zlevel;
+        }
+        zout.next_out  = (Bytef*)zbuf;
+        zout.avail_out = sizeof(zbuf);
+        rc = Z_OK;
+        if (zparam != zlevel) {
+            rc = deflateParams(&zout, zlevel, Z_DEFAULT_STRATEGY);
+            zparam = zlevel;
+        }
+        zout.next_in  = (Bytef*)buf;
+        zout.avail_in = n;
+        if (rc == Z_OK) rc = deflate(&zout, Z_SYNC_FLUSH);
+        zdirty   = 1;
+        deflated = 1;
+        if (rc == Z_OK && zout.avail_in == 0 && zout.avail_out > 0) {
+            len = sizeof(zbuf) - zout.avail_out;
+        }
+        if (len > n - n / 16) len = 0;
+        if (!len && first) *packed = 1;
+    }
+
+sendData:
+    if (!len && zdirty) {
+        deflateReset(&zout);
+        zdirty = 0;
+    }
+    t1 = now();
+    if (len) {
+        putRecord(recZData, zbuf, len, info);
+    } else {
+        putRecord(recData, buf, n, info);
+    }
+    t2 = now();
+    if (deflated || zlevel == 0) adaptLevel(t1 - t0, t2 - t1, n);
+}
+
+
+/* Send `n' bytes of `fd' as recData.  They are moved by splice() or
+   sendfile() without being copied to user space, or are read and
+   written if neither works for the file.  Zeros are sent for the bytes
+   that can't be read.  Return the number of bytes read from `fd', or
+   -1 on a read error.
+ */
+static ssize_t
+spliceData (int fd, size_t n, bkupInfo* info)
+{
+    static char buf[recChunk];
+    char        hdr[recHdrLen + 1];
+    size_t      done = 0;
+    ssize_t     m;
+    int         out = fileno(info->stream);
+    int         err = 0;
+
+
+    snprintf(hdr, sizeof(hdr), "%c%08x", recData, (unsigned)n);
+    pthread_mutex_lock(&streamLock);
+    if (fwrite(hdr, 1, recHdrLen, info->stream) != recHdrLen ||
+        fflush(info->stream)) {
+        goto writeError;
+    }
+    while (done < n && zeroCopy) {
+        if (outPipe) {
+            m = splice(fd, NULL, out, NULL, n - done, SPLICE_F_MOVE);
+        } else {
+            m = sendfile(out, fd, NULL, n - done);
+        }
+        if (m > 0) {
+            done += m;
+        } else if (m == 0) {
+            goto padZeros;      /* the file shrank */
+        } else if (errno == EINVAL || errno == ENOSYS) {
+            zeroCopy = 0;
+        } else if (errno == EPIPE || errno == ECONNRESET) {
+            goto writeError;
+        } else if (errno != EINTR) {
+            err = errno;
+            goto padZeros;
+        }
+    }
+    while (done < n) {
+        m = read(fd, buf, (n - done < sizeof(buf)) ? n - done : sizeof(buf));
+        if (m <= 0) {
+            if (m < 0 && errno == EINTR) continue;
+            if (m < 0) err = errno;
+            break;
+        }
+        if (fwrite(buf, 1, m, info->stream) != m) goto writeError;
+        done += m;
+    }
+
+padZeros:
+    if (done < n) memset(buf, 0, sizeof(buf));
+    for (m = done; m < n; m += sizeof(buf)) {
+        if (fwrite(buf, 1, (n - m < sizeof(buf)) ? n - m : sizeof(buf),
+                   info->stream) == 0) {
+            goto writeError;
+        }
+    }
+    pthread_mutex_unlock(&streamLock);
+    errno = err;
+    return err ? -1 : done;
+
+writeError:
+    errSysRet(("write(stream: %c)", recData));
+    pthread_mutex_unlock(&streamLock);
+    backupfsExit(info, 1);
+    return -1;                  /* to make gcc happy */
+}
+
+
+/* Send `path' as recFile and recData, or as recSame if another name
+   of it has already been sent.  Called by one thread at a time.
+   Return 1 if succeeded.  Return 0 otherwise.
+ */
+int
+putFile (char* path, bkupInfo* info)
+{
+    static char buf[recChunk];
+    struct stat st;
+    char        key[40];
+    char*       rec;
+    char*       first;
+    off_t       left;
+    off_t       lost;           /* bytes not read */
+    ssize_t     n;
+    int         len;
+    int         packed;
+    int         fd = -1;
+    int         rv = 0;
+
+
+    assert(path);
+    assert(info);
+
+    if (lstat(path, &st)) {
+        errSysRet(("lstat(%s)", path));
+        return 0;
+    }
+    if (S_ISREG(st.st_mode)) {
+        fd = open(path, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &st)) {
+            errSysRet(("open(%s)", path));
+            goto closeReturn;
+        }
+    }
+    len = strlen(path);
+    if (!S_ISDIR(st.st_mode) && st.st_nlink > 1) {
+        if (!sentFiles) sentFiles = stringRBTcreate();
+        snprintf(key, sizeof(key), "%llx:%llx",
+                 (unsigned long long)st.st_dev, (unsigned long long)st.st_ino);
+        first = sentFiles ? stringRBTfind(sentFiles, key) : NULL;
+        if (first) {
+            rec = malloc(len + strlen(first) + 2);
+            if (!rec) errSysExit(("malloc(%s)", path));
+            strcpy(rec, path);
+            strcpy(rec + len + 1, first);
+            putRecord(recSame, rec, len + strlen(first) + 1, info);
+            free(rec);
+            rv = 1;
+            goto closeReturn;
+        }
+        first = strdup(path);
+        if (sentFiles && first && stringRBTinsert(sentFiles, key, first)) {
+            free(first);
+        }
+    }
+
+    rec = malloc(len + 128 + (S_ISLNK(st.st_mode) ? st.st_size + 1 : 0));
+    if (!rec) errSysExit(("malloc(%s)", path));
+    len = sprintf(rec, "0x%08x 0x%08x 0x%08x 0x%llx 0x%lx 0x%llx 0x%llx %s",
+                  (int)st.st_uid, (int)st.st_gid, st.st_mode,
+                  (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+                  (unsigned long long)st.st_rdev,
+                  S_ISREG(st.st_mode) ? (long long)st.st_size : 0LL, path);
+    if (S_ISLNK(st.st_mode)) {
+        n = readlink(path, rec + len + 1, st.st_size + 1);
+        if (n < 0 || n > st.st_size) {
+            errSysRet(("readlink(%s)", path));
+            free(rec);
+            goto closeReturn;
+        }
+        len += 1 + n;
+    }
+    putRecord(recFile, rec, len, info);
+    free(rec);
+    rv = 1;
+    if (fd < 0) goto closeReturn;
+
+    if (zdirty) {
+        deflateReset(&zout);
+        zdirty = 0;
+    }
+    packed = isPacked(path);
+
+    /* A file must be sent in the size of recFile like tar does.
+     */
+    for (left = st.st_size; left > 0; left -= n) {
+        if (zeroCopy && (packed || zlevel == 0)) {
+            /* Not to be compressed: send it as is without copying
+             */
+            len = (left < pipeSize) ? left : pipeSize;
+            n   = spliceData(fd, len, info);
+            if (zlevel == 0) adaptLevel(0, 0, len);
+            if (n == len) continue;
+            lost  = left - (n > 0 ? n : 0);
+            left -= len;        /* zeros are sent up to `len' */
+        } else {
+            n = read(fd, buf, (left < sizeof(buf)) ? left : sizeof(buf));
+            if (n > 0) {
+                putData(buf, n, left == st.st_size, &packed, info);
+                continue;
+            }
+            lost = left;
+        }
+        if (n < 0) {
+            errSysRet(("read(%s)", path));
+        } else {
+            errRet(("%s: shrank by %lld bytes. Padded with zeros",
+                                              path, (long long)lost));
+        }
+        memset(buf, 0, sizeof(buf));
+        for (; left > 0; left -= n) {
+            n = (left < sizeof(buf)) ? left : sizeof(buf);
+            putData(buf, n, 0, &packed, info);
+        }
+        rv = 0;
+        break;
+    }
+
+closeReturn:
+    if (fd >= 0) close(fd);
+    return rv;
+}
+
+
+/* Free the path names remembered by putFile()
+ */
+static void
+freeSent (const char* key, void* val, void* arg)
+{
+    free(val);
+}
+
+
+void
+freeSentFiles (void)
+{
+    if (!sentFiles) return;
+    stringRBTwalk(sentFiles, freeSent, NULL);
+    stringRBTdestroy(sentFiles);
+    sentFiles = NULL;
+}
+
+
+typedef struct {
+    off_t     size;
+    char*     key;              /* "dev:ino" or NULL */
+    char*     path;
+} queuedFile;
+
+/* A symbolic link, or another name of one (recSame), made after
+   all the files are written
+ */
+typedef struct {
+    char*     path;             /* in the backup */
+    char*     target;           /* link target, or the first name */
+    int       same;             /* recSame */
+    uid_t     uid;
+    gid_t     gid;
+    struct timespec tm[2];
+} lateLink;
+
+typedef struct {
+    int       in;               /* the stream */
+    char*     rbuf;             /* read from `in' (recChunk bytes) */
+    size_t    rpos;             /* next byte in rbuf */
+    size_t    rend;             /* end of the bytes in rbuf */
+    int       noSplice;         /* splice() doesn't work for r->fd */
+    bkupInfo* info;
+    char*     data;             /* data of the current record */
+    size_t    dsize;            /* malloc'ed size of data */
+    size_t    len;              /* length of data */
+    int       bfd;              /* info->bdir (O_PATH) */
+    char*     lbdir;            /* last backup directory (recTime) */
+    int       lbfd;             /* lbdir (O_PATH), or -1 */
+    dirCache* dc;               /* directories in bdir and lbdir */
+    int       fd;               /* file receiving recData */
+    char*     file;             /* its path name */
+    off_t     left;             /* recData bytes still to come */
+    uid_t     uid;
+    gid_t     gid;
+    mode_t    mode;
+    struct timespec tm[2];      /* atime, mtime */
+    z_stream  zs;               /* inflates recZData */
+    int       zinit;            /* inflateInit() is done */
+    int       zbad;             /* ignore data of r->file */
+    char*     zbuf;             /* recChunk bytes for inflate() */
+    queuedFile* queue;          /* recQueue */
+    int       nqueue;
+    int       qmax;
+    lateLink* late;             /* made by makeLateLinks() */
+    int       nlate;
+    int       lmax;
+    int       errors;
+} streamReader;
+
+
+/* Make r->rbuf have some bytes of the stream.
+   Return the number of them, or 0 at EOF or on an error.
+ */
+static size_t
+fillIn (streamReader* r)
+{
+    ssize_t n;
+
+
+    while (r->rpos == r->rend) {
+        n = read(r->in, r->rbuf, recChunk);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) errSysRet(("read(stream)"));
+            return 0;
+        }
+        r->rpos = 0;
+        r->rend = n;
+    }
+    return r->rend - r->rpos;
+}
+
+
+/* Read `n' bytes of the stream into `dst', or skip them if `dst' is
+   NULL.  Return 1 on success, 0 at EOF or on an error.
+ */
+static int
+readIn (streamReader* r, char* dst, size_t n)
+{
+    size_t m;
+
+
+    while (n > 0) {
+        m = fillIn(r);
+        if (m == 0) return 0;
+        if (m > n) m = n;
+        if (dst) {
+            memcpy(dst, r->rbuf + r->rpos, m);
+            dst += m;
+        }
+        r->rpos += m;
+        n -= m;
+    }
+    return 1;
+}
+
+
+/* Write `len' bytes of `data' to r->fd.  It is closed on an error.
+ */
+static void
+writeOut (streamReader* r, char* data, size_t len)
+{
+    char*   p;
+    ssize_t n;
+
+
+    for (p = data; r->fd >= 0 && p < data + len; p += n) {
+        n = write(r->fd, p, data + len - p);
+        if (n < 0) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            errSysRet(("write(%s)", r->file));
+            ++r->errors;
+            close(r->fd);
+            r->fd = -1;
+        }
+    }
+}
+
+
+/* Move `n' bytes of the stream to r->fd.  What is not in r->rbuf
+   is moved by splice() without being copied to user space where it
+   works.  The bytes are dropped if r->fd is closed.
+ */
+static void
+copyIn (streamReader* r, size_t n)
+{
+    ssize_t m;
+
+
+    m = r->rend - r->rpos;
+    if (m > n) m = n;
+    writeOut(r, r->rbuf + r->rpos, m);
+    r->rpos += m;
+    n -= m;
+    while (n > 0 && r->fd >= 0 && !r->noSplice) {
+        m = splice(r->in, NULL, r->fd, NULL, n, SPLICE_F_MOVE);
+        if (m > 0) {
+            n -= m;
+        } else if (m == 0) {
+            return;             /* EOF: getRecord() tells it */
+        } else if (errno == EINVAL || errno == ENOSYS) {
+            r->noSplice = 1;
+        } else if (errno != EINTR) {
+            errSysRet(("splice(%s)", r->file));
+            ++r->errors;
+            close(r->fd);
+            r->fd = -1;
+        }
+    }
+    while (n > 0 && (m = fillIn(r)) > 0) {
+        if (m > n) m = n;
+        writeOut(r, r->rbuf + r->rpos, m);
+        r->rpos += m;
+        n -= m;
+    }
+}
+
+
+/* Read a record into r->data, but recData which is left in the
+   stream for recvData().  Return its type, or 0 at EOF or if
+   the length is over recMaxLen.
+ */
+static int
+getRecord (streamReader* r)
+{
+    char  hdr[recHdrLen + 1];
+    char* p;
+
+
+    if (!readIn(r, hdr, recHdrLen)) return 0;
+    hdr[recHdrLen] = '\0';
+    r->len = strtoul(hdr + 1, NULL, 16);
+    if (r->len > recMaxLen) {
+        errRet(("%c: bad record length 0x%s", hdr[0], hdr + 1));
+        return 0;
+    }
+    if (hdr[0] == recData) return recData;
+    if (r->len + 1 > r->dsize) {
+        p = realloc(r->data, r->len + 1);
+        if (!p) errSysExit(("realloc(%d)", r->len + 1));
+        r->data  = p;
+        r->dsize = r->len + 1;
+    }
+    if (!readIn(r, r->data, r->len)) {
+        errRet(("%c: short record", hdr[0]));
+        return 0;
+    }
+    r->data[r->len] = '\0';
+    return hdr[0];
+}
+
+
+/* Return malloc'ed `dir' + `path'
+ */
+static char*
+catPath (char* dir, char* path)
+{
+    char* p;
+
+
+    p = malloc(strlen(dir) + strlen(path) + 1);
+    if (!p) errSysExit(("malloc(%s%s)", dir, path));
+    strcpy(p, dir);
+    strcat(p, path);
+    return p;
+}
+
+
+/* Is `path' of a record "/<name>/..." under info->src, or also
+   info->src or a directory above it if `dir'?  "." and ".." and
+   empty names are not allowed.  Count an error if not.
+ */
+static int
+checkPath (streamReader* r, char* path, int dir)
+{
+    char*  src  = r->info->src;
+    size_t slen = strlen(src);
+    size_t plen = strlen(path);
+    char*  p;
+
+
+    while (slen > 0 && src[slen - 1] == '/') --slen;
+    if (*path != '/') goto badPath;
+    for (p = path; p; p = index(p + 1, '/')) {
+        if (p[1] == '/' || p[1] == '\0') goto badPath;
+        if (p[1] == '.' && (p[2] == '/' || p[2] == '\0')) goto badPath;
+        if (p[1] == '.' && p[2] == '.' &&
+            (p[3] == '/' || p[3] == '\0')) goto badPath;
+    }
+    if (!strncmp(path, src, slen) && path[slen] == '/') return 1;
+    if (dir && plen <= slen && !strncmp(path, src, plen) &&
+        (src[plen] == '/' || src[plen] == '\0')) return 1;
+
+badPath:
+    errRet(("%s: bad path name", path));
+    ++r->errors;
+    return 0;
+}
+
+
+/* Open `path' relative to `root' without leaving it or following
+   a symbolic link: the records come from the remote host, and are
+   applied as root.  Without openat2() (before Linux 5.6), open the
+   directories one by one with O_NOFOLLOW; `path' has no "..".
+ */
+static int
+openBeneath (int root, char* path, int flags, mode_t mode)
+{
+    struct open_how how;
+    char*           copy;
+    char*           s;
+    int             dfd, fd;
+    int             err;
+
+
+    memset(&how, 0, sizeof(how));
+    how.flags   = flags | O_CLOEXEC;
+    how.mode    = (flags & O_CREAT) ? mode : 0;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS;
+    fd = syscall(SYS_openat2, root, path, &how, sizeof(how));
+    if (fd >= 0 || errno != ENOSYS) return fd;
+
+    copy = strdup(path);
+    if (!copy) errSysExit(("strdup(%s)", path));
+    dfd = root;
+    for (path = copy; (s = index(path, '/')); path = s + 1) {
+        *s = '\0';
+        fd = openat(dfd, path, O_PATH|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+        err = errno;
+        if (dfd != root) close(dfd);
+        dfd = fd;
+        if (dfd < 0) goto freeReturn;
+    }
+    fd  = openat(dfd, path, flags|O_NOFOLLOW|O_CLOEXEC, mode);
+    err = errno;
+    if (dfd != root) close(dfd);
+
+freeReturn:
+    free(copy);
+    errno = err;
+    return fd;
+}
+
+
+/* dirOpener of r->dc: open a directory in info->bdir or r->lbdir
+ */
+static int
+openDirStream (char* path, void* arg)
+{
+    streamReader* r = arg;
+    size_t        len;
+    int           root;
+
+
+    len = strlen(r->info->bdir);
+    if (!strncmp(path, r->info->bdir, len) &&
+        (path[len] == '/' || path[len] == '\0')) {
+        root = r->bfd;
+    } else if (r->lbdir && (len = strlen(r->lbdir)) &&
+               !strncmp(path, r->lbdir, len) &&
+               (path[len] == '/' || path[len] == '\0')) {
+        root = r->lbfd;
+    } else {
+        errno = EXDEV;
+        return -1;
+    }
+    path += len;
+    while (*path == '/') ++path;
+    return openBeneath(root, *path ? path : ".", O_PATH|O_DIRECTORY, 0);
+}
+
+
+static void
+linkFailedStream (char* src, char* dest, int err, void* arg)
+{
+    streamReader* r = arg;
+
+    errno = err;
+    errSysRet(("link(%s, %s)", src, dest));
+    ++r->errors;
+}
+
+
+/* Hard link `src' to `dest'
+ */
+static void
+linkRecord (streamReader* r, char* src, char* dest)
+{
+    if (!dirCacheLink(src, dest, r->dc)) {
+        errSysRet(("link(%s, %s)", src, dest));
+        ++r->errors;
+    }
+}
+
+
+/* recData of r->file are all received
+ */
+static void
+closeRecvFile (streamReader* r)
+{
+    if (r->fd >= 0) {
+        if (fchown(r->fd, r->uid, r->gid)) {
+            errSysRet(("chown(%s)", r->file));
+        }
+        if (fchmod(r->fd, r->mode & ~S_IFMT)) {
+            errSysRet(("chmod(%s)", r->file));
+        }
+        if (futimens(r->fd, r->tm)) {
+            errSysRet(("utimes(%s)", r->file));
+        }
+        if (close(r->fd)) {
+            errSysRet(("close(%s)", r->file));
+            ++r->errors;
+        }
+        r->fd = -1;
+    }
+    free(r->file);
+    r->file = NULL;
+}
+
+
+/* Remember a symbolic link (`same' is 0) or a hard link to one
+   for makeLateLinks()
+ */
+static void
+addLateLink (streamReader* r, char* path, char* target, int same)
+{
+    lateLink* l;
+
+
+    if (r->nlate == r->lmax) {
+        r->lmax = r->lmax ? 2 * r->lmax : 256;
+        l = realloc(r->late, r->lmax * sizeof(*r->late));
+        if (!l) errSysExit(("realloc(%d)", r->lmax));
+        r->late = l;
+    }
+    l = r->late + r->nlate;
+    l->path   = catPath(r->info->bdir, path);
+    l->target = same ? catPath(r->info->bdir, target) : strdup(target);
+    if (!l->target) errSysExit(("strdup(%s)", target));
+    l->same   = same;
+    l->uid    = r->uid;
+    l->gid    = r->gid;
+    l->tm[0]  = r->tm[0];
+    l->tm[1]  = r->tm[1];
+    ++r->nlate;
+}
+
+
+/* Make the symbolic links after all the files are written, so
+   that no record is applied through one of them
+ */
+static void
+makeLateLinks (streamReader* r)
+{
+    lateLink* l;
+    char*     base;
+    int       dfd;
+
+
+    for (l = r->late; l < r->late + r->nlate; ++l) {
+        if (l->same) {
+            linkRecord(r, l->target, l->path);
+            continue;
+        }
+        dfd = dirCacheDir(r->dc, l->path, &base);
+        if (dfd < 0) {
+            errSysRet(("open(%s)", l->path));
+            ++r->errors;
+            continue;
+        }
+        if (unlinkat(dfd, base, 0) && errno != ENOENT) {
+            errSysRet(("unlink(%s)", l->path));
+        }
+        if (symlinkat(l->target, dfd, base)) {
+            errSysRet(("symlink(%s, %s)", l->target, l->path));
+            ++r->errors;
+            continue;
+        }
+        if (fchownat(dfd, base, l->uid, l->gid, AT_SYMLINK_NOFOLLOW)) {
+            errSysRet(("lchown(%s)", l->path));
+        }
+        if (utimensat(dfd, base, l->tm, AT_SYMLINK_NOFOLLOW)) {
+            errSysRet(("utimes(%s)", l->path));
+        }
+    }
+}
+
+
+/* recFile: make the file, or start receiving its recData
+ */
+static void
+recvFile (streamReader* r)
+{
+    unsigned long long rdev, size;
+    char* p;
+    char* target;
+    char* base;
+    int   dfd;
+
+
+    if (r->file) {
+        errRet(("%s: %lld bytes missing", r->file, (long long)r->left));
+        ++r->errors;
+        closeRecvFile(r);
+    }
+    r->uid  = strtoul(r->data, &p, 16);
+    r->gid  = strtoul(p, &p, 16);
+    r->mode = strtoul(p, &p, 16);
+    r->tm[1].tv_sec  = strtoll(p, &p, 16);
+    r->tm[1].tv_nsec = strtol(p, &p, 16);
+    rdev = strtoull(p, &p, 16);
+    size = strtoull(p, &p, 16);
+    if (*p++ != ' ') {
+        errRet(("%s: wrong file record", r->data));
+        ++r->errors;
+        return;
+    }
+    r->tm[0] = r->tm[1];
+    r->file  = catPath(r->info->bdir, p);
+    r->left  = size;
+    r->zbad  = 0;
+    if (r->zinit) inflateReset(&r->zs);
+    if (!checkPath(r, p, 0)) {
+        goto dropFile;          /* recData are dropped */
+    }
+    if (S_ISLNK(r->mode)) {
+        target = p + strlen(p) + 1;
+        if (target > r->data + r->len) {
+            errRet(("%s: no link target", r->file));
+            ++r->errors;
+        } else {
+            addLateLink(r, p, target, 0);
+        }
+        goto dropFile;
+    }
+    dfd = dirCacheDir(r->dc, r->file, &base);
+    if (dfd < 0) {
+        errSysRet(("open(%s)", r->file));
+        ++r->errors;
+        goto dropFile;
+    }
+    if (unlinkat(dfd, base, 0) && errno != ENOENT) {
+        errSysRet(("unlink(%s)", r->file));
+    }
+
+    if (S_ISREG(r->mode)) {
+        r->fd = openat(dfd, base,
+                       O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, S_IRUSR);
+        if (r->fd < 0) {
+            errSysRet(("open(%s)", r->file));
+            ++r->errors;
+        }
+        if (r->left == 0) closeRecvFile(r);
+        return;
+    }
+    if (mknodat(dfd, base, r->mode, rdev)) {
+        errSysRet(("mknod(%s, 0x%08x)", r->file, r->mode));
+        ++r->errors;
+    } else {
+        if (fchownat(dfd, base, r->uid, r->gid, AT_SYMLINK_NOFOLLOW)) {
+            errSysRet(("chown(%s)", r->file));
+        }
+        if (fchmodat(dfd, base, r->mode & ~S_IFMT, 0)) {
+            errSysRet(("chmod(%s)", r->file));
+        }
+        if (utimensat(dfd, base, r->tm, AT_SYMLINK_NOFOLLOW)) {
+            errSysRet(("utimes(%s)", r->file));
+        }
+    }
+
+dropFile:
+    if (!S_ISREG(r->mode)) r->left = 0;
+    if (r->left == 0) closeRecvFile(r);
+}
+
+
+/* Is `len' bytes of data expected for r->file?
+ */
+static int
+dataExpected (streamReader* r, size_t len)
+{
+    if (!r->file || len > r->left) {
+        errRet(("%s: %d bytes of unexpected data",
+                r->file ? r->file : "", (int)len));
+        ++r->errors;
+        r->zbad = 1;
+        return 0;
+    }
+    return 1;
+}
+
+
+/* Write `len' bytes of `data' to r->file
+ */
+static void
+writeData (streamReader* r, char* data, size_t len)
+{
+    if (!dataExpected(r, len)) return;
+    r->left -= len;
+    writeOut(r, data, len);
+    if (r->left == 0) closeRecvFile(r);
+}
+
+
+/* recData: move it from the stream to r->file
+ */
+static void
+recvData (streamReader* r)
+{
+    if (r->zbad || !dataExpected(r, r->len)) {
+        readIn(r, NULL, r->len);
+        return;
+    }
+    if (r->zinit) inflateReset(&r->zs);
+    r->left -= r->len;
+    copyIn(r, r->len);
+    if (r->left == 0) closeRecvFile(r);
+}
+
+
+/* recZData: inflate it and write it to r->file
+ */
+static void
+recvZData (streamReader* r)
+{
+    int rc;
+
+
+    if (r->zbad) return;
+    if (!r->zinit) {
+        r->zbuf = malloc(recChunk);
+        if (!r->zbuf) {
+            errSysRet(("malloc(%d)", recChunk));
+            goto badData;
+        }
+        if (inflateInit(&r->zs) != Z_OK) {
+            errRet(("inflateInit: %s", r->zs.msg ? r->zs.msg : ""));
+            goto badData;
+        }
+        r->zinit = 1;
+    }
+
+    r->zs.next_in  = (Bytef*)r->data;
+    r->zs.avail_in = r->len;
+    do {
+        r->zs.next_out  = (Bytef*)r->zbuf;
+        r->zs.avail_out = recChunk;
+        rc = inflate(&r->zs, Z_SYNC_FLUSH);
+        if (rc != Z_OK && rc != Z_BUF_ERROR) {
+            errRet(("%s: inflate: %s", r->file ? r->file : "",
+                    r->zs.msg ? r->zs.msg : zError(rc)));
+            goto badData;
+        }
+        if (r->zs.avail_out < recChunk) {
+            writeData(r, r->zbuf, recChunk - r->zs.avail_out);
+            if (r->zbad) return;
+        }
+    } while (r->zs.avail_in > 0 || r->zs.avail_out == 0);
+    return;
+
+badData:
+    ++r->errors;
+    r->zbad = 1;
+}
+
+
+/* recTime: r->lbdir is <dest>/yyyy/mm/dd of the time
+ */
+static void
+recvTime (streamReader* r)
+{
+    struct tm tm;
+    time_t    t;
+    int       len;
+
+
+    t = strtol(r->data, NULL, 16);
+    if (!localtime_r(&t, &tm)) {
+        errExit(("localtime(0x%08lx) failed", t));
+    }
+    len = strlen(r->info->dest) + strlen(BKUP_DIR) + 2;
+    free(r->lbdir);
+    r->lbdir = malloc(len);
+    if (!r->lbdir) errSysExit(("malloc(%d)", len));
+    snprintf(r->lbdir, len, "%s/%04d/%02d/%02d", r->info->dest,
+             tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+    if (r->lbfd >= 0) close(r->lbfd);
+    r->lbfd = open(r->lbdir, O_PATH|O_DIRECTORY|O_CLOEXEC);
+    if (r->lbfd < 0) errSysRet(("open(%s)", r->lbdir));
+}
+
+
+/* recDir: make the directory, or set its owner and mode if it
+   exists, as makeNewDir() does, but only in info->bdir
+ */
+static void
+recvDir (streamReader* r)
+{
+    size_t len = strlen(r->info->bdir);
+    uid_t  uid;
+    gid_t  gid;
+    mode_t mode;
+    char*  base;
+    char*  p;
+    int    exist = 0;
+    int    dfd, fd;
+
+
+    uid  = strtol(r->data, &p, 16);
+    gid  = strtol(p, &p, 16);
+    mode = strtol(p, &p, 16);
+    if (*p++ != ' ') {
+        errRet(("%s: wrong directory record", r->data));
+        ++r->errors;
+        return;
+    }
+    if (strncmp(p, r->info->bdir, len) || p[len] != '/') {
+        errRet(("%s: not in %s", p, r->info->bdir));
+        ++r->errors;
+        return;
+    }
+    if (!checkPath(r, p + len, 1)) return;
+    dfd = dirCacheDir(r->dc, p, &base);
+    if (dfd < 0) {
+        errSysRet(("open(%s)", p));
+        ++r->errors;
+        return;
+    }
+    if (mkdirat(dfd, base, mode)) {
+        if (errno != EEXIST) {
+            errSysRet(("mkdir(%s, 0x%08x)", p, mode));
+            ++r->errors;
+            return;
+        }
+        exist = 1;
+    }
+    fd = openat(dfd, base, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    if (fd < 0) {
+        errSysRet(("open(%s)", p));
+        ++r->errors;
+        return;
+    }
+    if (fchown(fd, uid, gid)) {
+        errSysRet(("chown(%s, 0x%08x, 0x%08x)", p, uid, gid));
+        ++r->errors;
+    } else if (exist && fchmod(fd, mode)) {
+        errSysRet(("chmod(%s, 0x%08x)", p, mode));
+        ++r->errors;
+    }
+    close(fd);
+}
+
+
+/* recLink: link the file from the last backup
+ */
+static void
+recvLink (streamReader* r)
+{
+    char* path = r->data;
+    char* old  = r->data;
+    char* src;
+    char* dest;
+
+
+    if (!r->lbdir) {
+        errRet(("%s: no last backup to link from", r->data));
+        ++r->errors;
+        return;
+    }
+    if (!strncmp(path, LINK_MOVED, strlen(LINK_MOVED))) {
+        /* Moved file: "=<new path>\0<old path>"
+         */
+        path += strlen(LINK_MOVED);
+        old   = path + strlen(path) + 1;
+        if (old > r->data + r->len) {
+            errRet(("%s: no old path name", path));
+            ++r->errors;
+            return;
+        }
+    }
+    if (!checkPath(r, path, 0) || (old != path && !checkPath(r, old, 0))) {
+        return;
+    }
+    src  = catPath(r->lbdir, old);
+    dest = catPath(r->info->bdir, path);
+    linkRecord(r, src, dest);
+    free(src);
+    free(dest);
+}
+
+
+/* recSame: link another name of a file sent in this backup
+ */
+static void
+recvSame (streamReader* r)
+{
+    char* first = r->data + strlen(r->data) + 1;
+    char* src;
+    char* dest;
+    char* base;
+    struct stat st;
+    int   dfd;
+
+
+    if (first > r->data + r->len) {
+        errRet(("%s: no first name", r->data));
+        ++r->errors;
+        return;
+    }
+    if (!checkPath(r, r->data, 0) || !checkPath(r, first, 0)) return;
+    src  = catPath(r->info->bdir, first);
+    dest = catPath(r->info->bdir, r->data);
+    if (r->nlate > 0) {
+        /* The first name may be a symbolic link yet to be made
+         */
+        dfd = dirCacheDir(r->dc, src, &base);
+        if (dfd >= 0 && fstatat(dfd, base, &st, AT_SYMLINK_NOFOLLOW) &&
+            errno == ENOENT) {
+            addLateLink(r, r->data, first, 1);
+            free(src);
+            free(dest);
+            return;
+        }
+    }
+    linkRecord(r, src, dest);
+    free(src);
+    free(dest);
+}
+
+
+/* recQueue: add it to r->queue
+ */
+static void
+recvQueue (streamReader* r)
+{
+    queuedFile* q;
+    char*       key;
+    char*       p;
+    off_t       size;
+
+
+    size = strtoull(r->data, &p, 16);
+    key  = *p == ' ' ? ++p : NULL;
+    p    = key ? index(key, ' ') : NULL;
+    if (!p) {
+        errRet(("%s: wrong queue record", r->data));
+        ++r->errors;
+        return;
+    }
+    *p++ = '\0';
+    if (!checkPath(r, p, 0)) return;
+    if (r->nqueue == r->qmax) {
+        r->qmax = r->qmax ? 2 * r->qmax : 1024;
+        q = realloc(r->queue, r->qmax * sizeof(*r->queue));
+        if (!q) errSysExit(("realloc(%d)", r->qmax));
+        r->queue = q;
+    }
+    q = r->queue + r->nqueue;
+    q->size = size;
+    q->key  = strcmp(key, "-") ? strdup(key) : NULL;
+    q->path = strdup(p);
+    if (!q->path) errSysExit(("strdup(%s)", p));
+    ++r->nqueue;
+}
+
+
+static int
+queueCmp (const void* a, const void* b)
+{
+    const queuedFile* x = a;
+    const queuedFile* y = b;
+
+    return x->size > y->size ? -1 : x->size < y->size;
+}
+
+
+/* Split r->queue into `n' lists of about the same bytes.
+   Names of a file go to the same list.  Return 1 on success.
+ */
+static int
+splitQueue (streamReader* r, FILE** list, int n)
+{
+    off_t* load;
+    void*  keys;
+    void*  v;
+    int    i, j, k;
+    int    rv = 0;
+
+
+    load = calloc(n, sizeof(*load));
+    keys = stringRBTcreate();
+    if (!load || !keys) {
+        errSysRet(("splitQueue"));
+        goto freeReturn;
+    }
+    qsort(r->queue, r->nqueue, sizeof(*r->queue), queueCmp);
+    for (i = 0; i < r->nqueue; ++i) {
+        v = r->queue[i].key ? stringRBTfind(keys, r->queue[i].key) : NULL;
+        if (v) {
+            k = (intptr_t)v - 1;
+        } else {
+            for (k = 0, j = 1; j < n; ++j) {
+                if (load[j] < load[k]) k = j;
+            }
+            load[k] += r->queue[i].size;
+            if (r->queue[i].key) {
+                stringRBTinsert(keys, r->queue[i].key, (void*)(intptr_t)(k+1));
+            }
+        }
+        if (fwrite(r->queue[i].path, strlen(r->queue[i].path) + 1, 1,
+                   list[k]) != 1) {
+            errSysRet(("fwrite(file list)"));
+            goto freeReturn;
+        }
+    }
+    for (k = 0; k < n; ++k) {
+        if (fflush(list[k]) || fseek(list[k], 0, SEEK_SET)) {
+            errSysRet(("fflush(file list)"));
+            goto freeReturn;
+        }
+    }
+    rv = 1;
+
+freeReturn:
+    if (keys) stringRBTdestroy(keys);
+    free(load);
+    return rv;
+}
+
+
+/* Fetch the files in `list' with backupfs-remote -f.
+   This runs in a child process.  Return its exit status.
+ */
+static int
+fetchList (FILE* list, bkupInfo* info)
+{
+    pipeExitSt st;
+    char*      cmd;
+    int        len;
+    int        rv;
+
+
+    /* ssh -i <rsa_id> backupfs@<host> \
+       backupfs-remote -f [-H] <src-dir> <bkup-dir> < list
+     */
+    len = strlen(RMT_FETCH) + strlen(info->sshid) + strlen(info->user) +
+          strlen(info->host) + strlen(info->src) + strlen(info->bdir) + 1;
+    cmd = malloc(len);
+    if (!cmd) errSysExit(("malloc(cmd:%d)", len));
+    snprintf(cmd, len, RMT_FETCH, info->sshid, info->user, info->host,
+             info->hdd ? "-H " : "", info->src, info->bdir);
+    info->ackfd = -1;
+    st = execReader(cmd, recvStream, fileno(list), info, &rv);
+    rv = chkCmdExitSt(st, cmd) && rv;
+    free(cmd);
+    return !rv;
+}
+
+
+/* recWait: fetch r->queue over info->streams ssh connections at the
+   same time (0: one per streamBytes, up to maxStreams, or one with -H).
+   Return 1 if all of them are fetched.
+ */
+static int
+fetchQueue (streamReader* r)
+{
+    bkupInfo* info = r->info;
+    FILE*     list[maxWalkThreads];
+    pid_t     pid[maxWalkThreads];
+    off_t     total = 0;
+    int       status;
+    int       n, i;
+    int       rv = 0;
+
+
+    for (i = 0; i < r->nqueue; ++i) total += r->queue[i].size;
+    n = info->streams;
+    if (n <= 0) {
+        n = info->hdd ? 1 : 1 + total / streamBytes;
+        if (n > maxStreams) n = maxStreams;
+    }
+    if (n > maxWalkThreads) n = maxWalkThreads;
+    if (n > r->nqueue) n = r->nqueue;
+
+    memset(list, 0, sizeof(list));
+    for (i = 0; i < n; ++i) {
+        list[i] = tmpfile();
+        if (!list[i]) {
+            errSysRet(("tmpfile"));
+            goto closeReturn;
+        }
+    }
+    if (n > 0 && !splitQueue(r, list, n)) goto closeReturn;
+
+    fflush(stdout);
+    fflush(stderr);
+    for (i = 0; i < n; ++i) {
+        pid[i] = fork();
+        if (pid[i] < 0) errSysExit(("fork"));
+        if (pid[i] == 0) {
+            status = fetchList(list[i], info);
+            fflush(stdout);
+            _exit(status);      /* r->dc and atexit() are the parent's */
+        }
+    }
+    rv = 1;
+    for (i = 0; i < n; ++i) {
+        while (waitpid(pid[i], &status, 0) < 0) {
+            if (errno != EINTR) {
+                errSysRet(("wait(%d)", (int)pid[i]));
+                status = -1;
+                break;
+            }
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status)) rv = 0;
+    }
+
+closeReturn:
+    for (i = 0; i < n; ++i) {
+        if (list[i]) fclose(list[i]);
+    }
+    return rv;
+}
+
+
+/* recWait: fetch the queued files, and tell backupfs-remote -l
+   whether they are all fetched.
+ */
+static void
+recvWait (streamReader* r)
+{
+    char c;
+
+
+    if (r->info->ackfd < 0) {
+        errRet(("%s: unexpected wait record", r->info->host));
+        ++r->errors;
+        return;
+    }
+    c = fetchQueue(r) ? '1' : '0';
+    if (c != '1') ++r->errors;
+    if (write(r->info->ackfd, &c, 1) != 1) {
+        errSysRet(("write(ack)"));
+        ++r->errors;
+    }
+}
+
+
+/* Apply the records from backupfs-remote (`in') to the backup
+   directory info->bdir until recEnd.
+   Return 1 if all of them are applied.  Return 0 otherwise.
+ */
+int
+recvStream (FILE* in, bkupInfo* info)
+{
+    streamReader r;
+    int          type;
+    int          i;
+    int          end = 0;
+
+
+    assert(in);
+    assert(info);
+    assert(info->bdir);
+
+    memset(&r, 0, sizeof(r));
+    r.in   = fileno(in);
+    r.rbuf = malloc(recChunk);
+    if (!r.rbuf) errSysExit(("malloc(%d)", recChunk));
+    r.info = info;
+    r.fd   = -1;
+    r.lbfd = -1;
+    r.bfd  = open(info->bdir, O_PATH|O_DIRECTORY|O_CLOEXEC);
+    if (r.bfd < 0) errSysExit(("open(%s)", info->bdir));
+    r.dc   = dirCacheNew(2 * maxWalkThreads);
+    if (!r.dc) errExit(("can't keep directories open"));
+    dirCacheOpener(r.dc, openDirStream, &r);
+    dirCacheRing(r.dc, linkFailedStream, &r);
+
+    while (!end && (type = getRecord(&r))) {
+        switch (type) {
+        case recTime:
+            recvTime(&r);
+            break;
+        case recDir:
+            recvDir(&r);
+            break;
+        case recLink:
+            recvLink(&r);
+            break;
+        case recFile:
+            recvFile(&r);
+            break;
+        case recData:
+            recvData(&r);
+            break;
+        case recZData:
+            recvZData(&r);
+            break;
+        case recSame:
+            recvSame(&r);
+            break;
+        case recPrint:
+            fwrite(r.data, 1, r.len, stdout);
+            break;
+        case recQueue:
+            recvQueue(&r);
+            break;
+        case recWait:
+            recvWait(&r);
+            break;
+        case recEnd:
+            end = 1;
+            break;
+        default:
+            errRet(("0x%02x: unknown record", type));
+            ++r.errors;
+            end = -1;
+            break;
+        }
+    }
+    if (end == 0) {
+        errRet(("%s: stream ended without end record", info->host));
+        ++r.errors;
+    }
+    if (r.file) {
+        errRet(("%s: %lld bytes missing", r.file, (long long)r.left));
+        ++r.errors;
+        closeRecvFile(&r);
+    }
+    makeLateLinks(&r);
+    dirCacheFree(r.dc);         /* make queued links */
+    if (r.zinit) inflateEnd(&r.zs);
+    for (i = 0; i < r.nqueue; ++i) {
+        free(r.queue[i].key);
+        free(r.queue[i].path);
+    }
+    free(r.queue);
+    for (i = 0; i < r.nlate; ++i) {
+        free(r.late[i].path);
+        free(r.late[i].target);
+    }
+    free(r.late);
+    close(r.bfd);
+    if (r.lbfd >= 0) close(r.lbfd);
+    free(r.zbuf);
+    free(r.rbuf);
+    free(r.lbdir);
+    free(r.data);
+    fflush(stdout);
+    return !r.errors;
+}
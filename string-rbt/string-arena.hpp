@@ -0,0 +1,117 @@
+/* $Id$
+
+   string-arena.hpp: bump allocator for the nodes and keys of
+                     string-rbt.cc and string-hash.cc
+
+
+   Copyright (c) 2026, Yoichi Hariguchi
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+       o Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+       o Redistributions in binary form must reproduce the above
+         copyright notice, this list of conditions and the following
+         disclaimer in the documentation and/or other materials provided
+         with the distribution.
+       o Neither the name of the Yoichi Hariguchi nor the names of its
+         contributors may be used to endorse or promote products derived
+         from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#ifndef __STRING_ARENA_HPP__
+#define __STRING_ARENA_HPP__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace stringArena
+{
+
+/*
+ * Memory is carved out of large chunks and never returned
+ * one piece at a time: the whole arena is freed when the
+ * tree (or table) that owns it is destroyed.
+ */
+class arena
+{
+private:
+    struct chunk {
+        chunk* next;
+    };
+    enum {
+        chunkSize = 1 << 20,    // default chunk size in bytes
+        align     = 16,         // alignment of alloc()
+    };
+    chunk* head;
+    char*  cur;
+    char*  end;
+
+    arena (const arena&);
+    arena& operator= (const arena&);
+public:
+    arena () : head(NULL), cur(NULL), end(NULL) {};
+    ~arena () {
+        while (head) {
+            chunk* next = head->next;
+            free(head);
+            head = next;
+        }
+    };
+
+    void* alloc (size_t size, size_t alignment = align) {
+        char*  p;
+        size_t len;
+
+        p = (char*)(((uintptr_t)cur + alignment - 1) & ~(alignment - 1));
+        if (!cur || p + size > end) {
+            len = sizeof(chunk) + align + size;
+            if (len < chunkSize) {
+                len = chunkSize;
+            }
+            chunk* c = (chunk*)malloc(len);
+            if (!c) {
+                return NULL;
+            }
+            c->next = head;
+            head = c;
+            cur  = (char*)c + sizeof(chunk);
+            end  = (char*)c + len;
+            p = (char*)(((uintptr_t)cur + alignment - 1) & ~(alignment - 1));
+        }
+        cur = p + size;
+        return p;
+    };
+
+    char* strdup (const char* s) {
+        size_t len = strlen(s) + 1;
+        char*  p   = (char*)alloc(len, 1);
+
+        if (p) {
+            memcpy(p, s, len);
+        }
+        return p;
+    };
+};
+
+} // namespace stringArena
+
+
+#endif // __STRING_ARENA_HPP__
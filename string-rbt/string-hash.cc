@@ -0,0 +1,368 @@
+/* $Id$
+
+   string-hash.cc: An open addressing hash table whose key is an
+                   ASCII string that can be called by C functions.
+                   It implements the API in string-rbt.h and can
+                   replace string-rbt.cc (see Makefile).
+
+
+   Copyright (c) 2026, Yoichi Hariguchi
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+       o Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+       o Redistributions in binary form must reproduce the above
+         copyright notice, this list of conditions and the following
+         disclaimer in the documentation and/or other materials provided
+         with the distribution.
+       o Neither the name of the Yoichi Hariguchi nor the names of its
+         contributors may be used to endorse or promote products derived
+         from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include "string-hash.hpp"
+#include "string-rbt.h"
+
+
+namespace stringHash
+{
+
+/**
+ * @name  table::hash
+ *
+ * @brief 64-bit FNV-1a hash of `key' with a final mix so that
+ *        the low bits used as the slot index depend on all bytes.
+ */
+uint64_t
+table::hash (const char* key)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    for (; *key; ++key) {
+        h ^= (unsigned char)*key;
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 32;
+    return h;
+}
+
+/**
+ * @name  table::probe
+ *
+ * @brief Internal function.
+ *        It returns the first empty slot for hash value `h'.
+ *        The table must have at least one empty slot.
+ */
+slot*
+table::probe (uint64_t h) const
+{
+    size_t i;
+
+    for (i = h & mask; tbl[i].key; i = (i + 1) & mask)
+        ;
+    return &tbl[i];
+}
+
+/**
+ * @name  table::find
+ *
+ * @brief Internal function.
+ *        It returns the slot whose key is `key' (hash value `h'),
+ *        or NULL if there is none. It allocates no memory.
+ */
+slot*
+table::find (const char* key, uint64_t h) const
+{
+    size_t i;
+
+    if (!tbl) {
+        return NULL;
+    }
+    for (i = h & mask; tbl[i].key; i = (i + 1) & mask) {
+        if (tbl[i].hash == h && strcmp(tbl[i].key, key) == 0) {
+            return &tbl[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @name  table::grow
+ *
+ * @brief Internal function.
+ *        It doubles the number of slots (or allocates `minSlots')
+ *        and moves the entries with their saved hash values.
+ *
+ * @retval 0       Success
+ * @retval -ENOMEM Failed to allocate memory
+ */
+int
+table::grow ()
+{
+    slot*  old  = tbl;
+    size_t size = tbl ? 2 * (mask + 1) : (size_t)minSlots;
+    size_t i;
+
+    tbl = (slot*)calloc(size, sizeof(slot));
+    if (!tbl) {
+        tbl = old;
+        return -ENOMEM;
+    }
+    if (old) {
+        for (i = 0; i <= mask; ++i) {
+            if (old[i].key) {
+                size_t j;
+                for (j = old[i].hash & (size - 1); tbl[j].key;
+                     j = (j + 1) & (size - 1))
+                    ;
+                tbl[j] = old[i];
+            }
+        }
+        free(old);
+    }
+    mask = size - 1;
+    return 0;
+}
+
+/**
+ * @name  table::insert
+ *
+ * @retval 0          Success
+ * @retval -ENOMEM    Failed to allocate memory
+ * @retval -EOVERFLOW The table already has `key'
+ */
+int
+table::insert (const char* key, void* value)
+{
+    uint64_t h = hash(key);
+    slot*    s;
+    char*    k;
+
+    if (find(key, h)) {
+        return -EOVERFLOW;
+    }
+    if (!tbl || (count + 1) * 100 > (mask + 1) * maxLoad) {
+        if (grow() < 0) {
+            return -ENOMEM;
+        }
+    }
+    k = keys.strdup(key);
+    if (!k) {
+        return -ENOMEM;
+    }
+    s = probe(h);
+    s->hash  = h;
+    s->key   = k;
+    s->value = value;
+    ++count;
+    return 0;
+}
+
+/**
+ * @name  table::remove
+ *
+ * @brief It removes `key' and shifts the following entries of
+ *        the probe sequence back so that no tombstone is left.
+ *
+ * @retval void* The value associated with `key'
+ * @retval NULL  No matching entry found
+ */
+void*
+table::remove (const char* key)
+{
+    slot*  s = find(key, hash(key));
+    void*  value;
+    size_t i, j;
+
+    if (!s) {
+        return NULL;
+    }
+    value = s->value;           /* the key stays in the arena */
+    i = s - tbl;
+    for (j = (i + 1) & mask; tbl[j].key; j = (j + 1) & mask) {
+        /* Move tbl[j] to the hole at `i' unless its home slot
+           lies cyclically in (i, j].
+         */
+        if (((j - (tbl[j].hash & mask)) & mask) >= ((j - i) & mask)) {
+            tbl[i] = tbl[j];
+            i = j;
+        }
+    }
+    tbl[i].key = NULL;
+    --count;
+    return value;
+}
+
+} // namespace stringHash
+
+
+/**
+ * @name  stringRBTcreate
+ *
+ * @brief API Function.
+ *        It creates a hash table object.
+ *
+ * @retval void* Pointer to a new hash table object.
+ * @retval NULL  Failed to create a hash table object.
+ */
+void*
+stringRBTcreate (void)
+{
+    return new (std::nothrow) stringHash::table;
+}
+
+/**
+ * @name  stringRBTdestroy
+ *
+ * @brief API Function.
+ *        It frees the given hash table and all its keys at once.
+ *        The values are not freed.
+ *
+ * @param[in] rbt Pointer to a hash table
+ */
+void
+stringRBTdestroy (void* rbt)
+{
+    delete reinterpret_cast<stringHash::table*>(rbt);
+}
+
+/**
+ * @name  stringRBTinsert
+ *
+ * @brief API Function.
+ *        It inserts a (key, value) pair to the given hash table.
+ *
+ * @param[in] rbt   Pointer to a hash table
+ * @param[in] key   Pointer to the search key to be inserted to 'rbt'
+ * @param[in] value Pointer to the value associated with 'key'
+ *                  to be inserted to 'rbt'
+ *
+ * @retval 0          (key, value) paire is successfully inserted to 'rbt'
+ * @retval -EINVAL    'rbt' and/or key is NULL
+ * @retval -ENOMEM    Failed to allocate memory
+ * @retval -EOVERFLOW 'rbt' already has the same 'key'.
+ */
+int
+stringRBTinsert (void* rbt, const char* key, void* value)
+{
+    if (!rbt) {
+        return -EINVAL;
+    }
+    if (!key) {
+        return -EINVAL;
+    }
+    return reinterpret_cast<stringHash::table*>(rbt)->insert(key, value);
+}
+
+/**
+ * @name  stringRBTfind
+ *
+ * @brief API function.
+ *        It searches the given hash table for the entry
+ *        that matchees given key. No memory is allocated.
+ *
+ * @param[in] rbt Pointer to a hash table
+ * @param[in] key Pointer to the search key
+ *
+ * @retval void* Pointer to the matching entry
+ * @retval NULL  No matching entry found
+ */
+void*
+stringRBTfind (void* rbt, const char* key)
+{
+    stringHash::table* tbl = reinterpret_cast<stringHash::table*>(rbt);
+    stringHash::slot*  s;
+
+    if (!rbt || !key) {
+        return NULL;
+    }
+    s = tbl->find(key, stringHash::table::hash(key));
+    return s ? s->value : NULL;
+}
+
+/**
+ * @name  stringRBTremove
+ *
+ * @brief API function.
+ *        It removes the entry that matches the given key
+ *        from the given hash table.
+ *
+ * @param[in] rbt Pointer to a hash table
+ * @param[in] key Pointer to the search key to be removed
+ *
+ * @retval void* Pointer to the value whose associated key was
+ *               found in `rbt'. The matching entry is removed.
+ * @retval NULL  No matching entry found.
+ */
+void*
+stringRBTremove (void* rbt, const char* key)
+{
+    if (!rbt || !key) {
+        return NULL;
+    }
+    return reinterpret_cast<stringHash::table*>(rbt)->remove(key);
+}
+
+/**
+ * @name  stringRBTsize
+ *
+ * @brief API function.
+ *        It returns the number of entries in the given hash table.
+ *
+ * @param[in] rbt Pointer to a hash table
+ *
+ * @retval size_t The number of entries in `rbt'
+ */
+size_t
+stringRBTsize (void* rbt)
+{
+    return reinterpret_cast<stringHash::table*>(rbt)->size();
+}
+
+/**
+ * @name  stringRBTwalk
+ *
+ * @brief API function.
+ *        It visits all the entries in the given hash table (`rbt')
+ *        and calls the given function (`f') with the given parameter
+ *        (`arg'.) Unlike the red-black tree, the entries are visited
+ *        in no particular order.
+ *
+ * @param[in] rbt Pointer to a hash table
+ * @param[in] f   Pointer to a function to be called each time
+ *                `stringRBTwalk' visits an entry in `rbt'. See
+ *                string-rbt.cc for its parameters.
+ * @param[in] arg Pointer to be used as the third parameter for function `f'.
+ */
+void
+stringRBTwalk (void* rbt, stringRBTcb f, void* arg)
+{
+    stringHash::table* tbl = reinterpret_cast<stringHash::table*>(rbt);
+    size_t             i;
+
+    for (i = 0; i < tbl->capacity(); ++i) {
+        if (tbl->at(i)->key) {
+            (*f)(tbl->at(i)->key, tbl->at(i)->value, arg);
+        }
+    }
+}
@@ -0,0 +1,97 @@
+/* $Id$
+
+   string-hash.hpp: C++ header file for an open addressing hash
+                    table whose key is an ASCII string that can be
+                    called by C functions through string-rbt.h.
+
+
+   Copyright (c) 2026, Yoichi Hariguchi
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+       o Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+       o Redistributions in binary form must reproduce the above
+         copyright notice, this list of conditions and the following
+         disclaimer in the documentation and/or other materials provided
+         with the distribution.
+       o Neither the name of the Yoichi Hariguchi nor the names of its
+         contributors may be used to endorse or promote products derived
+         from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#ifndef __STRING_HASH_HPP__
+#define __STRING_HASH_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "string-arena.hpp"
+
+namespace stringHash
+{
+
+/*
+ * One slot of the table. `key' is NULL if the slot is empty.
+ * `hash' is kept so that probing and growing never rehash
+ * nor touch the key unless the hash values match.
+ */
+struct slot
+{
+    uint64_t    hash;
+    const char* key;            // in table::keys
+    void*       value;
+};
+
+/*
+ * Linear probing with backward shift deletion: no tombstones,
+ * so a lookup stops at the first empty slot.
+ */
+class table
+{
+private:
+    slot*  tbl;
+    size_t mask;                // # of slots - 1 (power of 2)
+    size_t count;               // # of keys
+    stringArena::arena keys;    // key strings; freed with the table
+public:
+    table () : tbl(NULL), mask(0), count(0) {};
+    ~table () { free(tbl); };
+
+    static uint64_t hash (const char* key);
+
+    slot*  find (const char* key, uint64_t h) const;
+    int    insert (const char* key, void* value);
+    void*  remove (const char* key);
+    size_t size () const { return count; };
+    size_t capacity () const { return tbl ? mask + 1 : 0; };
+    slot*  at (size_t i) const { return &tbl[i]; };
+private:
+    int    grow ();
+    slot*  probe (uint64_t h) const;
+};
+
+enum {
+    minSlots = 1024,            // initial # of slots
+    maxLoad  = 75,              // grow at `maxLoad' % full
+};
+
+} // namespace stringHash
+
+
+#endif // __STRING_HASH_HPP__
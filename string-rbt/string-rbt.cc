@@ -51,7 +51,7 @@
 void*
 stringRBTcreate (void)
 {
-    std::unique_ptr<stringRBT::rbt> tree(new stringRBT::rbt);
+    std::unique_ptr<stringRBT::tree> tree(new stringRBT::tree);
     if (tree.get()) {
         return tree.release();
     } else {
@@ -59,6 +59,21 @@ stringRBTcreate (void)
     }
 }
 
+/**
+ * @name  stringRBTdestroy
+ *
+ * @brief API Function.
+ *        It frees the given red-black tree with all its nodes
+ *        and keys at once. The values are not freed.
+ *
+ * @param[in] rbt Pointer to a red-black tree
+ */
+void
+stringRBTdestroy (void* rbt)
+{
+    delete reinterpret_cast<stringRBT::tree*>(rbt);
+}
+
 /**
  * @name  stringRBTinsert
  *
@@ -85,18 +100,19 @@ stringRBTinsert (void* rbt, const char* key, void* value)
         return -EINVAL;
     }
     std::pair<stringRBT::iterator, bool> rc;
-    stringRBT::rbt* tree = reinterpret_cast<stringRBT::rbt*>(rbt);
-    std::unique_ptr<stringRBT::node> node(new stringRBT::node);
-    if (!node.get()) {
+    stringRBT::tree* tree = reinterpret_cast<stringRBT::tree*>(rbt);
+    void* mem = tree->mem.alloc(sizeof(stringRBT::node));
+    char* k   = tree->mem.strdup(key);
+    if (!mem || !k) {
         return -ENOMEM;
     }
-    node->setKey(key);
+    stringRBT::node* node = new (mem) stringRBT::node;
+    node->setKey(k);
     node->setVal(value);
-    rc = tree->insert_unique(*node);
+    rc = tree->t.insert_unique(*node);
     if (!rc.second) {
-        return -EOVERFLOW;
+        return -EOVERFLOW;      /* `node' and `k' are left in the arena */
     }
-    node.release();
     return 0;
 }
 
@@ -116,9 +132,9 @@ stringRBTinsert (void* rbt, const char* key, void* value)
 void*
 stringRBTfind (void* rbt, const char* key)
 {
-    stringRBT::rbt* tree = reinterpret_cast<stringRBT::rbt*>(rbt);
+    stringRBT::tree* tree = reinterpret_cast<stringRBT::tree*>(rbt);
     stringRBT::const_iterator it = stringRBTfindNode(rbt, key);
-    if (it == tree->end()) {
+    if (it == tree->t.end()) {
         return NULL;
     }
     return it->getVal();
@@ -142,15 +158,13 @@ stringRBTfind (void* rbt, const char* key)
 void*
 stringRBTremove (void* rbt, const char* key)
 {
-    stringRBT::rbt* tree = reinterpret_cast<stringRBT::rbt*>(rbt);
+    stringRBT::tree* tree = reinterpret_cast<stringRBT::tree*>(rbt);
     stringRBT::const_iterator it = stringRBTfindNode(rbt, key);
-    if (it == tree->end()) {
+    if (it == tree->t.end()) {
         return NULL;
     }
     void* value = it->getVal();
-    stringRBT::node* node = it->getSelf();
-    tree->erase(it);
-    delete(node);
+    tree->t.erase(it);          /* the node stays in the arena */
     return value;
 }
 
@@ -167,8 +181,8 @@ stringRBTremove (void* rbt, const char* key)
 size_t
 stringRBTsize (void* rbt)
 {
-    stringRBT::rbt* tree = reinterpret_cast<stringRBT::rbt*>(rbt);
-    return tree->size();
+    stringRBT::tree* tree = reinterpret_cast<stringRBT::tree*>(rbt);
+    return tree->t.size();
 }
 
 /**
@@ -191,11 +205,11 @@ stringRBTsize (void* rbt)
 void
 stringRBTwalk (void* rbt, stringRBTcb f, void* arg)
 {
-    stringRBT::rbt* tree = reinterpret_cast<stringRBT::rbt*>(rbt);
+    stringRBT::tree* tree = reinterpret_cast<stringRBT::tree*>(rbt);
     stringRBT::const_iterator it;
 
-    for (it = tree->begin(); it != tree->end(); ++it) {
-        (*f)(it->getKey().c_str(), it->getVal(), arg);
+    for (it = tree->t.begin(); it != tree->t.end(); ++it) {
+        (*f)(it->getKey(), it->getVal(), arg);
     }
 }
 
@@ -215,15 +229,14 @@ stringRBTwalk (void* rbt, stringRBTcb f, void* arg)
 stringRBT::const_iterator
 stringRBTfindNode (void* rbt, const char* key)
 {
-    std::pair<stringRBT::iterator, bool> rc;
-    stringRBT::rbt* tree = reinterpret_cast<stringRBT::rbt*>(rbt);
+    stringRBT::tree* tree = reinterpret_cast<stringRBT::tree*>(rbt);
     stringRBT::node node;
     if (!rbt) {
-        return tree->end();
+        return tree->t.end();
     }
     if (!key) {
-        return tree->end();
+        return tree->t.end();
     }
-    node.setKey(key);
-    return tree->find(node);
+    node.setKey(key);           /* no copy: `node' is only compared */
+    return tree->t.find(node);
 }
@@ -47,6 +47,7 @@ extern "C" {
 typedef void (*stringRBTcb)(const char *key, void *val, void *arg);
 
 void*  stringRBTcreate (void);
+void   stringRBTdestroy (void *rbt);
 int    stringRBTinsert (void *rbt, const char *key, void *value);
 void*  stringRBTremove (void *rbt, const char *key);
 void*  stringRBTfind (void *rbt, const char *key);
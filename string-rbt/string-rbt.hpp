@@ -40,8 +40,10 @@
 
 #include <iostream>
 #include <memory>
+#include <string.h>
 #include <boost/intrusive/rbtree.hpp>
 #include <boost/format.hpp>
+#include "string-arena.hpp"
 
 namespace stringRBT
 {
@@ -50,30 +52,39 @@ class node : public boost::intrusive::
                     set_base_hook<boost::intrusive::optimize_size<true> >
 {
 private:
-    std::string key;
+    const char *key;            // in the arena: see arena::strdup
     void *value;
     node *self;
 public:
     node () { self = this; };
 
     friend bool operator<(const node &a, const node &b)
-        { return a.key < b.key; };
+        { return strcmp(a.key, b.key) < 0; };
     friend bool operator>(const node &a, const node &b)
-        { return a.key > b.key; };
+        { return strcmp(a.key, b.key) > 0; };
     friend bool operator==(const node &a, const node &b)
-        { return a.key == b.key; };
-    void  setKey (const std::string &s) { key = s; };
+        { return strcmp(a.key, b.key) == 0; };
     void  setKey (const char *s) { key = s; };
     void* getVal (void) const { return value; };
     void  setVal (void *val) { value = val; };
     node* getSelf() const { return self; };
-  const std::string getKey() const { return std::move(key); };
+    const char* getKey() const { return key; };
 };
 
 typedef boost::intrusive::rbtree<node> rbt;
 typedef rbt::iterator iterator;
 typedef rbt::const_iterator const_iterator;
 
+/*
+ * The red-black tree and the arena its nodes and keys live in.
+ * `mem' is declared first so that it outlives `t'.
+ */
+struct tree
+{
+    stringArena::arena mem;
+    rbt                t;
+};
+
 } // namespace stringRBT
 
 /*
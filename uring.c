@@ -0,0 +1,457 @@
+/* $Id$
+
+   uring.c: statx and minimal io_uring rings for the walker threads
+
+
+   Copyright (c) 2026, Yoichi Hariguchi
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+       o Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+       o Redistributions in binary form must reproduce the above
+         copyright notice, this list of conditions and the following
+         disclaimer in the documentation and/or other materials provided
+         with the distribution.
+       o Neither the name of the Yoichi Hariguchi nor the names of its
+         contributors may be used to endorse or promote products derived
+         from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "backupfs.h"
+#include "error.h"
+
+
+/* What dirwalk() and the backups need of a directory entry:
+   no atime, blocks or birth time, which some file systems
+   have to work for. st_dev is always filled.
+ */
+#ifdef STATX_TYPE
+#define WALK_STATX  (STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | \
+                     STATX_GID | STATX_INO | STATX_SIZE | STATX_MTIME | \
+                     STATX_CTIME)
+
+static void
+statxToStat (struct statx* x, struct stat* st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_dev          = makedev(x->stx_dev_major, x->stx_dev_minor);
+    st->st_ino          = x->stx_ino;
+    st->st_mode         = x->stx_mode;
+    st->st_nlink        = x->stx_nlink;
+    st->st_uid          = x->stx_uid;
+    st->st_gid          = x->stx_gid;
+    st->st_rdev         = makedev(x->stx_rdev_major, x->stx_rdev_minor);
+    st->st_size         = x->stx_size;
+    st->st_blksize      = x->stx_blksize;
+    st->st_blocks       = x->stx_blocks;
+    st->st_atim.tv_sec  = x->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = x->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec  = x->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = x->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec  = x->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = x->stx_ctime.tv_nsec;
+}
+
+
+
+/* lstat `name' in directory `dfd' asking for WALK_STATX only.
+   If `dontSync' is set, take the attributes cached by a
+   network file system instead of asking the server.
+   Return 0 on success, -1 on failure with errno set.
+ */
+int
+statAt (int dfd, char* name, struct stat* st, int dontSync)
+{
+    struct statx stx;
+
+
+    if (statx(dfd, name, AT_SYMLINK_NOFOLLOW |
+                         (dontSync ? AT_STATX_DONT_SYNC : 0),
+              WALK_STATX, &stx)) {
+        return -1;
+    }
+    statxToStat(&stx, st);
+    return 0;
+}
+
+#else  /* no statx */
+
+int
+statAt (int dfd, char* name, struct stat* st, int dontSync)
+{
+    return fstatat(dfd, name, st, AT_SYMLINK_NOFOLLOW);
+}
+
+#endif
+
+
+/* Backups are mostly metadata: a stat of every source file and
+   a hard link for every unchanged one. io_uring lets a thread
+   queue many of them and enter the kernel once per batch.
+   There is no liburing dependency; only what backupfs needs is
+   here. uringOpen() returns NULL if the kernel doesn't support
+   io_uring, linkat or statx on it (Linux 5.15 or later), and
+   the caller does the system calls by itself.
+ */
+#if defined(__linux__) && defined(IORING_FEAT_CQE_SKIP)
+/* IORING_OP_* are enums. Linux 5.17 headers have all the ones
+   used here.
+ */
+
+struct _uring {
+    int                  fd;
+    unsigned             entries;   /* # of SQ entries */
+    unsigned*            sqHead;
+    unsigned*            sqTail;
+    unsigned*            sqMask;
+    unsigned*            sqArray;
+    unsigned*            cqHead;
+    unsigned*            cqTail;
+    unsigned*            cqMask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void*                sqRing;
+    size_t               sqLen;
+    void*                cqRing;    /* == sqRing if single mmap */
+    size_t               cqLen;
+    size_t               sqesLen;
+    unsigned             tail;      /* SQ tail including unsubmitted */
+    unsigned             queued;    /* # of unsubmitted SQEs */
+    struct statx*        stx;       /* uringStat() buffers */
+};
+
+
+static int
+uringSupports (int fd)
+{
+    static int             op[] = { IORING_OP_LINKAT, IORING_OP_STATX };
+    struct io_uring_probe* probe;
+    size_t                 len;
+    int                    i, rv = 0;
+
+
+    len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    probe = calloc(1, len);
+    if (!probe) return 0;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+                probe, 256) < 0) {
+        goto freeReturn;
+    }
+    for (i = 0; i < (int)(sizeof(op)/sizeof(op[0])); ++i) {
+        if (op[i] > probe->last_op) goto freeReturn;
+        if (!(probe->ops[op[i]].flags & IO_URING_OP_SUPPORTED)) {
+            goto freeReturn;
+        }
+    }
+    rv = 1;
+
+freeReturn:
+    free(probe);
+    return rv;
+}
+
+
+/* Set up a ring of `entries' SQEs.
+   Return NULL if io_uring can't be used.
+ */
+uring*
+uringOpen (unsigned entries)
+{
+    struct io_uring_params p;
+    uring*                 r;
+    char*                  sq;
+    char*                  cq;
+
+
+    r = calloc(1, sizeof(*r));
+    if (!r) return NULL;
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        free(r);
+        return NULL;
+    }
+    if (!uringSupports(r->fd)) goto errorReturn;
+
+    r->entries = p.sq_entries;
+    r->sqLen   = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cqLen   = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cqLen > r->sqLen) r->sqLen = r->cqLen;
+        r->cqLen = r->sqLen;
+    }
+    r->sqRing = mmap(NULL, r->sqLen, PROT_READ|PROT_WRITE,
+                     MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sqRing == MAP_FAILED) {
+        r->sqRing = NULL;
+        goto errorReturn;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cqRing = r->sqRing;
+    } else {
+        r->cqRing = mmap(NULL, r->cqLen, PROT_READ|PROT_WRITE,
+                         MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cqRing == MAP_FAILED) {
+            r->cqRing = NULL;
+            goto errorReturn;
+        }
+    }
+    r->sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqesLen, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto errorReturn;
+    }
+    sq = r->sqRing;
+    cq = r->cqRing;
+    r->sqHead  = (unsigned*)(sq + p.sq_off.head);
+    r->sqTail  = (unsigned*)(sq + p.sq_off.tail);
+    r->sqMask  = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sqArray = (unsigned*)(sq + p.sq_off.array);
+    r->cqHead  = (unsigned*)(cq + p.cq_off.head);
+    r->cqTail  = (unsigned*)(cq + p.cq_off.tail);
+    r->cqMask  = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes    = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    r->tail    = *r->sqTail;
+    r->stx     = calloc(r->entries, sizeof(*r->stx));
+    if (!r->stx) goto errorReturn;
+    return r;
+
+errorReturn:
+    uringClose(r);
+    return NULL;
+}
+
+
+void
+uringClose (uring* r)
+{
+    if (!r) return;
+    free(r->stx);
+    if (r->sqes) munmap(r->sqes, r->sqesLen);
+    if (r->cqRing && r->cqRing != r->sqRing) munmap(r->cqRing, r->cqLen);
+    if (r->sqRing) munmap(r->sqRing, r->sqLen);
+    close(r->fd);
+    free(r);
+}
+
+
+/* Return # of SQEs which can be queued before uringSubmit()
+ */
+unsigned
+uringSpace (uring* r)
+{
+    return r->entries -
+           (r->tail - __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE));
+}
+
+
+/* Queue an operation. `op' is one of IORING_OP_*; the other
+   arguments are set to the SQE fields of the same names.
+   Return 0 if the ring is full.
+ */
+static int
+uringQueue (uring* r, int op, int fd, void* addr, unsigned len,
+            uint64_t off, int opFlags, uint64_t data)
+{
+    struct io_uring_sqe* sqe;
+    unsigned             idx;
+
+
+    if (!uringSpace(r)) return 0;
+    idx = r->tail & *r->sqMask;
+    sqe = r->sqes + idx;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = op;
+    sqe->fd        = fd;
+    sqe->addr      = (uintptr_t)addr;
+    sqe->len       = len;
+    sqe->off       = off;
+    sqe->rw_flags  = opFlags;
+    sqe->user_data = data;
+    r->sqArray[idx] = idx;
+    ++r->tail;
+    ++r->queued;
+    return 1;
+}
+
+
+/* Submit the queued SQEs and wait for `wait' completions.
+   Return 1 on success, 0 on failure with errno set.
+ */
+int
+uringSubmit (uring* r, unsigned wait)
+{
+    long n;
+
+
+    __atomic_store_n(r->sqTail, r->tail, __ATOMIC_RELEASE);
+    for (;;) {
+        n = syscall(__NR_io_uring_enter, r->fd, r->queued, wait,
+                    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n < 0) {
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY) return 0;
+            continue;
+        }
+        r->queued -= n;
+        if (!r->queued) break;
+    }
+    return 1;
+}
+
+
+/* Get a completion. Return 0 if there is none.
+ */
+int
+uringReap (uring* r, uint64_t* data, int* res)
+{
+    struct io_uring_cqe* cqe;
+    unsigned             head;
+
+
+    head = *r->cqHead;
+    if (head == __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE)) return 0;
+    cqe = r->cqes + (head & *r->cqMask);
+    *data = cqe->user_data;
+    *res  = cqe->res;
+    __atomic_store_n(r->cqHead, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+
+/* Queue linkat(ofd, old, nfd, new, 0). `old' and `new' must
+   stay as they are until the completion is reaped.
+ */
+int
+uringLinkat (uring* r, int ofd, char* old, int nfd, char* new, uint64_t data)
+{
+    return uringQueue(r, IORING_OP_LINKAT, ofd, old, nfd,
+                      (uintptr_t)new, 0, data);
+}
+
+
+/* statAt() `n' names in directory `dfd' a ring full at a time.
+   ok[i] is set to 1 if st[i] was filled. The ring must have
+   nothing else queued.
+ */
+void
+uringStat (uring* r, int dfd, char** name, int n, struct stat* st, int* ok,
+           int dontSync)
+{
+    uint64_t data;
+    int      res;
+    int      i, k, m;
+
+
+    for (i = 0; i < n; i += m) {
+        m = n - i;
+        if (m > (int)r->entries) m = r->entries;
+        for (k = 0; k < m; ++k) {
+            ok[i + k] = 0;
+            uringQueue(r, IORING_OP_STATX, dfd, name[i + k],
+                       WALK_STATX, (uintptr_t)(r->stx + k),
+                       AT_SYMLINK_NOFOLLOW |
+                       (dontSync ? AT_STATX_DONT_SYNC : 0), k);
+        }
+        if (!uringSubmit(r, m)) {
+            errSysExit(("io_uring_enter(statx)"));
+        }
+        for (k = 0; k < m; ) {
+            if (!uringReap(r, &data, &res)) {
+                if (!uringSubmit(r, 1)) {
+                    errSysExit(("io_uring_enter(statx)"));
+                }
+                continue;
+            }
+            ++k;
+            if (res < 0) continue;
+            statxToStat(r->stx + data, st + i + data);
+            ok[i + data] = 1;
+        }
+    }
+}
+
+#else  /* no io_uring */
+
+uring*
+uringOpen (unsigned entries)
+{
+    return NULL;
+}
+
+void
+uringClose (uring* r)
+{
+}
+
+unsigned
+uringSpace (uring* r)
+{
+    return 0;
+}
+
+int
+uringLinkat (uring* r, int ofd, char* old, int nfd, char* new, uint64_t data)
+{
+    return 0;
+}
+
+int
+uringSubmit (uring* r, unsigned wait)
+{
+    errno = ENOSYS;
+    return 0;
+}
+
+int
+uringReap (uring* r, uint64_t* data, int* res)
+{
+    return 0;
+}
+
+void
+uringStat (uring* r, int dfd, char** name, int n, struct stat* st, int* ok,
+           int dontSync)
+{
+    memset(ok, 0, n * sizeof(*ok));
+}
+
+#endif